@@ -1,10 +1,123 @@
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <string>
 #include <vector>
 #include "stb_image.h"
 #include "stb_image_write.h"
 #include "ImageProcessing.h"
+#include "FrameArena.h"
+#include "FrameCache.h"
+#include "StabilizationPipeline.h"
+#include "Trace.h"
+
+static std::string framePath(const char *pattern, int index) {
+    char path[4096];
+    std::snprintf(path, sizeof(path), pattern, index);
+    return path;
+}
+
+// A numbered image sequence read and written as frames with printf style patterns such as frames/%04d.png
+struct ImageSequence {
+    std::string inputPattern;
+    std::string outputPattern;
+    int width = 0;
+    int height = 0;
+    int next = 0;
+    std::vector<uint8_t> encoded;
+};
+
+// Reads the size of the first frame
+static bool openSequence(ImageSequence &sequence) {
+    int nChannels;
+    float *first = stbi_loadf(framePath(sequence.inputPattern.c_str(), 0).c_str(), &sequence.width, &sequence.height, &nChannels, STBI_grey);
+    if (!first) {
+        std::cerr << "Failed to load " << framePath(sequence.inputPattern.c_str(), 0) << std::endl;
+        return false;
+    }
+    stbi_image_free(first);
+    return true;
+}
+
+static bool readFrame(ImageSequence &sequence, std::vector<double> &image) {
+    int frameWidth, frameHeight, nChannels;
+    float *data = stbi_loadf(framePath(sequence.inputPattern.c_str(), sequence.next).c_str(), &frameWidth, &frameHeight, &nChannels, STBI_grey);
+    if (!data) return false;
+    if (frameWidth != sequence.width || frameHeight != sequence.height) {
+        std::cerr << "Frame " << sequence.next << " is " << frameWidth << "x" << frameHeight << ", expected " << sequence.width << "x" << sequence.height << std::endl;
+        stbi_image_free(data);
+        return false;
+    }
+    image.assign(data, data + sequence.width * sequence.height);
+    stbi_image_free(data);
+    sequence.next++;
+    return true;
+}
+
+static void writeFrame(ImageSequence &sequence, int index, const std::vector<double> &image) {
+    convertImageTo8bit(image, sequence.width, sequence.height, 1, sequence.encoded);
+    stbi_write_png(framePath(sequence.outputPattern.c_str(), index).c_str(), sequence.width, sequence.height, 1, sequence.encoded.data(), sequence.width);
+}
+
+// Stabilizes a numbered image sequence, decoding and encoding overlap with tracking through the pipeline stages
+static int stabilizeSequence(const char *inputPattern, const char *outputPattern) {
+    ImageSequence sequence;
+    sequence.inputPattern = inputPattern;
+    sequence.outputPattern = outputPattern;
+    if (!openSequence(sequence)) return 1;
+
+    auto source = [&](std::vector<double> &image) { return readFrame(sequence, image); };
+    auto sink = [&](int index, const std::vector<double> &image, const FrameMotion &motion) {
+        writeFrame(sequence, index, image);
+        std::cout << index << ": " << motion.trackedFeatures << " features, shift " << motion.motion(0, 2) << ", " << motion.motion(1, 2) << std::endl;
+    };
+
+    stabilizeVideo(sequence.width, sequence.height, StabilizerOptions {}, source, sink);
+    return 0;
+}
+
+// Stabilizes every sequence of a list file, one "<input pattern> <output pattern>" pair per line, in one process
+static int stabilizeBatchList(const char *listPath) {
+    std::ifstream list(listPath);
+    if (!list) {
+        std::cerr << "Failed to open " << listPath << std::endl;
+        return 1;
+    }
+
+    std::vector<ImageSequence> sequences;
+    ImageSequence sequence;
+    while (list >> sequence.inputPattern >> sequence.outputPattern) {
+        if (!openSequence(sequence)) return 1;
+        sequences.push_back(sequence);
+    }
+
+    std::vector<StreamJob> jobs(sequences.size());
+    for (size_t i = 0; i < sequences.size(); i++) {
+        ImageSequence &stream = sequences[i];
+        jobs[i].width = stream.width;
+        jobs[i].height = stream.height;
+        jobs[i].source = [&stream](std::vector<double> &image) { return readFrame(stream, image); };
+        jobs[i].sink = [&stream](int index, const std::vector<double> &image, const FrameMotion &) { writeFrame(stream, index, image); };
+    }
+
+    const auto statistics = stabilizeBatch(jobs, StabilizerOptions {});
+    for (size_t i = 0; i < sequences.size(); i++) {
+        std::cout << sequences[i].inputPattern << ": " << statistics[i].decodedFrames << " frames" << std::endl;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // StabilizeVideo <input pattern> <output pattern>, printf style patterns such as frames/%04d.png numbered from 0
+    // StabilizeVideo --batch <list file> runs every pair of patterns in the list on one shared pool of workers
+    if (argc == 3 && std::string(argv[1]) == "--batch") return stabilizeBatchList(argv[2]);
+    if (argc == 3) return stabilizeSequence(argv[1], argv[2]);
+
+#ifdef OPTICAL_FLOW_ENABLE_TRACING
+    TraceRecorder recorder;
+    setTraceSink(&recorder);
+#endif
 
-int main() {
     int width, height, nChannels;
     // Load image in grayscale
     float *data = stbi_loadf("data.png", &width, &height, &nChannels, STBI_grey);
@@ -22,8 +135,19 @@ int main() {
     stbi_image_free(data);
     stbi_image_free(dataNext);
 
-    auto prevPts = goodFeaturesToTrack(prev, width, height, 0.01, 10.0);
-    auto nextPts = lucasKanadeOpticalFlow(prev, next, width, height, prevPts, 25);
+    // Scratch buffers for every stage are drawn from one arena
+    FrameArena arena;
+    std::vector<Vector2f> prevPts, nextPts;
+    std::vector<uint8_t> status;
+    std::vector<float> error;
+    // Detection and tracking share the gradients of the first frame through its cache
+    FrameCache prevFrame, nextFrame;
+    prevFrame.setFrame(prev, width, height, 1);
+    nextFrame.setFrame(next, width, height, 1);
+    goodFeaturesToTrack(prevFrame, 0.01, 10.0, prevPts, arena);
+    lucasKanadeOpticalFlowPyramid(prevFrame, nextFrame, prevPts, 25, nextPts, status, error, 1.0f);
+    // Drop features that failed to track or didn't survive the forward-backward check
+    removeRejectedFeatures(prevPts, nextPts, status);
     
     auto transformation = estimateAffineTransform(prevPts, nextPts, 5.0f);
     // auto nextPts = lucasKanadeOpticalFlowPyramid(prev, next, width, height, 3, prevPts, 25);
@@ -32,5 +156,14 @@ int main() {
         std::cout << nextPts[i].x - prevPts[i].x << ", " << nextPts[i].y - prevPts[i].y << std::endl;
     }
 
+#ifdef OPTICAL_FLOW_ENABLE_TRACING
+    setTraceSink(nullptr);
+    std::ofstream traceFile("trace.json");
+    recorder.writeChromeTrace(traceFile);
+    std::ofstream csvFile("trace.csv");
+    recorder.writeCsv(csvFile);
+    recorder.writeStageSummary(std::cerr);
+#endif
+
     return 0;
 }
\ No newline at end of file
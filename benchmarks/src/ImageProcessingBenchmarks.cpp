@@ -0,0 +1,449 @@
+#include <map>
+#include <tuple>
+#include <benchmark/benchmark.h>
+#include "ImageProcessing.h"
+#include "Ransac.h"
+#include "FrameArena.h"
+#include "SyntheticImage.h"
+
+// Frames are expensive to synthesize at 4K so each (width, height, frame) is generated once
+static const std::vector<double> &cachedFrame(int width, int height, int frame = 0) {
+    static std::map<std::tuple<int, int, int>, std::vector<double>> cache;
+    auto &image = cache[{width, height, frame}];
+    if (image.empty()) image = syntheticFrame(width, height, 1.5 * frame, -0.75 * frame);
+    return image;
+}
+
+static const std::vector<uint8_t> &cachedFrame8u(int width, int height, int frame = 0) {
+    static std::map<std::tuple<int, int, int>, std::vector<uint8_t>> cache;
+    auto &image = cache[{width, height, frame}];
+    if (image.empty()) {
+        const auto &source = cachedFrame(width, height, frame);
+        image.resize(source.size());
+        for (size_t i = 0; i < source.size(); i++) image[i] = static_cast<uint8_t>(std::lround(source[i] * 255.0));
+    }
+    return image;
+}
+
+// 480p, 1080p, 4K
+static void resolutions(benchmark::internal::Benchmark *b) {
+    b->Args({640, 480})->Args({1920, 1080})->Args({3840, 2160});
+    b->Unit(benchmark::kMillisecond);
+}
+
+static void resolutionsAndFeatures(benchmark::internal::Benchmark *b) {
+    for (auto [width, height] : {std::pair{640, 480}, std::pair{1920, 1080}, std::pair{3840, 2160}}) {
+        for (int features : {100, 500, 2000}) {
+            b->Args({width, height, features});
+        }
+    }
+    b->Unit(benchmark::kMillisecond);
+}
+
+static void setPixelCounters(benchmark::State &state, int width, int height) {
+    state.SetItemsProcessed(state.iterations() * width * height);
+    state.SetBytesProcessed(state.iterations() * width * height * sizeof(double));
+}
+
+static void BM_ConvolveImageKernel(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    const std::vector<std::vector<double>> kernel = {
+        {1.0 / 16.0, 1.0 / 8.0, 1.0 / 16.0},
+        {1.0 / 8.0, 1.0 / 4.0, 1.0 / 8.0},
+        {1.0 / 16.0, 1.0 / 8.0, 1.0 / 16.0}
+    };
+    std::vector<double> output;
+
+    for (auto _ : state) {
+        convolveImageKernel(image, width, height, 1, kernel, output);
+        benchmark::DoNotOptimize(output.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_ConvolveImageKernel)->Apply(resolutions);
+
+// Sobel as the tracker runs it, both normalized gradients per pixel
+static void BM_Sobel(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    std::vector<double> gradX, gradY;
+
+    for (auto _ : state) {
+        spatialGradients(image, width, height, gradX, gradY);
+        benchmark::DoNotOptimize(gradX.data());
+        benchmark::DoNotOptimize(gradY.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_Sobel)->Apply(resolutions);
+
+static void BM_BoxFilter(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    FrameArena arena;
+    std::vector<double> output;
+
+    for (auto _ : state) {
+        arena.reset();
+        boxFilter(image, width, height, 1, 5, true, output, arena);
+        benchmark::DoNotOptimize(output.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_BoxFilter)->Apply(resolutions);
+
+static void BM_GaussianPyramid(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    FrameArena arena;
+    std::vector<double> output;
+
+    for (auto _ : state) {
+        arena.reset();
+        gaussianPyramid(image, width, height, 1, output, arena);
+        benchmark::DoNotOptimize(output.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_GaussianPyramid)->Apply(resolutions);
+
+static void BM_BuildImagePyramid(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    FrameArena arena;
+    ImagePyramid pyramid;
+
+    for (auto _ : state) {
+        arena.reset();
+        buildImagePyramid(image, width, height, 3, pyramid, arena);
+        benchmark::DoNotOptimize(pyramid.levels.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_BuildImagePyramid)->Apply(resolutions);
+
+static void BM_CalculateCovarianceMatrix(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    FrameArena arena;
+    std::vector<double> output;
+
+    for (auto _ : state) {
+        arena.reset();
+        calculateCovarianceMatrix(image, width, height, 2, output, arena);
+        benchmark::DoNotOptimize(output.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_CalculateCovarianceMatrix)->Apply(resolutions);
+
+static void BM_HarrisCornerDetector(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    FrameArena arena;
+    std::vector<double> output;
+
+    for (auto _ : state) {
+        arena.reset();
+        harrisCornerDetector(image, width, height, 2, 0.04, output, arena);
+        benchmark::DoNotOptimize(output.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_HarrisCornerDetector)->Apply(resolutions);
+
+static void BM_ShiTomasiCornerDetector(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    FrameArena arena;
+    std::vector<double> output;
+
+    for (auto _ : state) {
+        arena.reset();
+        shiTomasiCornerDetector(image, width, height, 2, output, arena);
+        benchmark::DoNotOptimize(output.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_ShiTomasiCornerDetector)->Apply(resolutions);
+
+static void BM_Threshold(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto response = shiTomasiCornerDetector(cachedFrame(width, height), width, height, 2);
+    std::vector<double> output;
+
+    for (auto _ : state) {
+        threshold(response, width, height, 0.01, output);
+        benchmark::DoNotOptimize(output.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_Threshold)->Apply(resolutions);
+
+static void BM_NonMaximalSuppression(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto response = shiTomasiCornerDetector(cachedFrame(width, height), width, height, 2);
+    const auto thresholded = threshold(response, width, height, 0.01);
+    std::vector<double> output;
+
+    for (auto _ : state) {
+        nonMaximalSuppression(thresholded, width, height, 3, output);
+        benchmark::DoNotOptimize(output.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_NonMaximalSuppression)->Apply(resolutions);
+
+static void BM_GoodFeaturesToTrack(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    FrameArena arena;
+    std::vector<Vector2f> features;
+
+    for (auto _ : state) {
+        arena.reset();
+        goodFeaturesToTrack(image, width, height, 0.05, 10.0, features, arena);
+        benchmark::DoNotOptimize(features.data());
+    }
+    setPixelCounters(state, width, height);
+    state.counters["features"] = features.size();
+}
+BENCHMARK(BM_GoodFeaturesToTrack)->Apply(resolutions);
+
+static void BM_GoodFeaturesToTrackBucketed(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    FrameArena arena;
+    std::vector<Vector2f> features;
+
+    for (auto _ : state) {
+        arena.reset();
+        goodFeaturesToTrackBucketed(image, width, height, 0.05, 10.0, 8, 8, 16, features, arena);
+        benchmark::DoNotOptimize(features.data());
+    }
+    setPixelCounters(state, width, height);
+    state.counters["features"] = features.size();
+}
+BENCHMARK(BM_GoodFeaturesToTrackBucketed)->Apply(resolutions);
+
+static void BM_ConvertImageTo8bit(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame(width, height);
+    std::vector<uint8_t> output;
+
+    for (auto _ : state) {
+        convertImageTo8bit(image, width, height, 1, output);
+        benchmark::DoNotOptimize(output.data());
+    }
+    setPixelCounters(state, width, height);
+}
+BENCHMARK(BM_ConvertImageTo8bit)->Apply(resolutions);
+
+static void BM_LucasKanadeOpticalFlow(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1), count = state.range(2);
+    const auto &prev = cachedFrame(width, height, 0);
+    const auto &next = cachedFrame(width, height, 1);
+    const auto features = gridFeatures(width, height, count, 16);
+    FrameArena arena;
+    std::vector<Vector2f> tracked;
+    std::vector<uint8_t> status;
+    std::vector<float> error;
+
+    for (auto _ : state) {
+        arena.reset();
+        lucasKanadeOpticalFlow(prev, next, width, height, features, 21, tracked, status, error, arena);
+        benchmark::DoNotOptimize(tracked.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_LucasKanadeOpticalFlow)->Apply(resolutionsAndFeatures);
+
+static void BM_LucasKanadeOpticalFlowPyramid(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1), count = state.range(2);
+    const auto &prev = cachedFrame(width, height, 0);
+    const auto &next = cachedFrame(width, height, 1);
+    const auto features = gridFeatures(width, height, count, 16);
+    FrameArena arena;
+    std::vector<Vector2f> tracked;
+    std::vector<uint8_t> status;
+    std::vector<float> error;
+
+    for (auto _ : state) {
+        arena.reset();
+        lucasKanadeOpticalFlowPyramid(prev, next, width, height, 3, features, 21, tracked, status, error, arena);
+        benchmark::DoNotOptimize(tracked.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_LucasKanadeOpticalFlowPyramid)->Apply(resolutionsAndFeatures);
+
+// Tracking only, with both pyramids prebuilt
+static void BM_LucasKanadeOpticalFlowPrebuiltPyramid(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1), count = state.range(2);
+    const auto prev = buildImagePyramid(cachedFrame(width, height, 0), width, height, 3);
+    const auto next = buildImagePyramid(cachedFrame(width, height, 1), width, height, 3);
+    const auto features = gridFeatures(width, height, count, 16);
+    std::vector<Vector2f> tracked;
+    std::vector<uint8_t> status;
+    std::vector<float> error;
+
+    for (auto _ : state) {
+        lucasKanadeOpticalFlowPyramid(prev, next, features, 21, tracked, status, error);
+        benchmark::DoNotOptimize(tracked.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_LucasKanadeOpticalFlowPrebuiltPyramid)->Apply(resolutionsAndFeatures);
+
+static void BM_LucasKanadeOpticalFlowBatch(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1), count = state.range(2);
+    const int frameCount = 4;
+    std::vector<std::vector<double>> frames;
+    for (int k = 0; k < frameCount; k++) frames.push_back(cachedFrame(width, height, k));
+    const auto features = gridFeatures(width, height, count, 16);
+    std::vector<std::vector<uint8_t>> status;
+
+    for (auto _ : state) {
+        auto tracks = lucasKanadeOpticalFlowBatch(frames, width, height, 3, features, 21, status);
+        benchmark::DoNotOptimize(tracks.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count * (frameCount - 1));
+}
+BENCHMARK(BM_LucasKanadeOpticalFlowBatch)->Apply(resolutionsAndFeatures);
+
+// Grid LK flow field with both pyramids prebuilt, 720p included as the real time target
+static void BM_DenseOpticalFlow(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1), gridStep = state.range(2);
+    const auto prev = buildImagePyramid(cachedFrame(width, height, 0), width, height, 3);
+    const auto next = buildImagePyramid(cachedFrame(width, height, 1), width, height, 3, false);
+    std::vector<Vector2f> flow;
+
+    for (auto _ : state) {
+        denseOpticalFlow(prev, next, gridStep, 9, flow);
+        benchmark::DoNotOptimize(flow.data());
+    }
+    state.SetItemsProcessed(state.iterations() * width * height);
+}
+BENCHMARK(BM_DenseOpticalFlow)->Args({640, 480, 8})->Args({1280, 720, 8})->Args({1280, 720, 16})->Args({1920, 1080, 8})->Unit(benchmark::kMillisecond);
+
+// Known rotation and translation with 20% of correspondences replaced by outliers
+static void rotatedCorrespondences(int count, float angle, std::vector<Vector2f> &prevPts, std::vector<Vector2f> &nextPts) {
+    prevPts = gridFeatures(1920, 1080, count, 16);
+    nextPts.resize(prevPts.size());
+
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> outlier(0.0f, 1080.0f);
+    const float c = std::cos(angle), s = std::sin(angle);
+    for (int i = 0; i < count; i++) {
+        nextPts[i] = {c * prevPts[i].x - s * prevPts[i].y + 3.0f, s * prevPts[i].x + c * prevPts[i].y - 2.0f};
+        if (i % 5 == 0) nextPts[i] = {outlier(rng), outlier(rng)};
+    }
+}
+
+static void BM_EstimateAffineTransform(benchmark::State &state) {
+    const int count = state.range(0);
+    std::vector<Vector2f> prevPts, nextPts;
+    rotatedCorrespondences(count, 0.02f, prevPts, nextPts);
+
+    for (auto _ : state) {
+        auto transform = estimateAffineTransform(prevPts, nextPts, 1.0f);
+        benchmark::DoNotOptimize(transform.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_EstimateAffineTransform)->Arg(100)->Arg(500)->Arg(2000)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+// Every model on a pure shift, which all of them represent, so the smaller ones converge in fewer and cheaper
+// iterations
+static void BM_EstimateMotionModel(benchmark::State &state) {
+    const auto model = static_cast<MotionModel>(state.range(0));
+    const int count = state.range(1);
+    std::vector<Vector2f> prevPts, nextPts;
+    rotatedCorrespondences(count, 0.0f, prevPts, nextPts);
+
+    for (auto _ : state) {
+        auto transform = estimateMotionModel(prevPts, nextPts, model, 1.0f);
+        benchmark::DoNotOptimize(transform.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_EstimateMotionModel)->ArgsProduct({{0, 1, 2, 3}, {500, 10000}})->Unit(benchmark::kMicrosecond);
+
+// Adaptive against preemptive affine RANSAC with 20% outliers, preemptive scoring should barely grow with the count
+static void BM_PreemptiveRansac(benchmark::State &state) {
+    RansacOptions options;
+    options.preemptiveHypotheses = state.range(0);
+    const int count = state.range(1);
+    std::vector<Vector2f> prevPts, nextPts;
+    rotatedCorrespondences(count, 0.02f, prevPts, nextPts);
+    Ransac<AffineModel> ransac(options);
+
+    for (auto _ : state) {
+        auto result = ransac.estimate(prevPts, nextPts);
+        benchmark::DoNotOptimize(result.transform.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_PreemptiveRansac)->ArgsProduct({{0, 128}, {500, 2000, 10000, 50000}})->Unit(benchmark::kMicrosecond);
+
+static void BM_CalculateCovarianceMatrix8u(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame8u(width, height);
+    std::vector<int32_t> output;
+
+    for (auto _ : state) {
+        calculateCovarianceMatrix(image, width, height, 2, output);
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetItemsProcessed(state.iterations() * width * height);
+    state.SetBytesProcessed(state.iterations() * width * height);
+}
+BENCHMARK(BM_CalculateCovarianceMatrix8u)->Apply(resolutions);
+
+static void BM_ShiTomasiCornerDetector8u(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame8u(width, height);
+    std::vector<float> output;
+
+    for (auto _ : state) {
+        shiTomasiCornerDetector(image, width, height, 2, output);
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetItemsProcessed(state.iterations() * width * height);
+    state.SetBytesProcessed(state.iterations() * width * height);
+}
+BENCHMARK(BM_ShiTomasiCornerDetector8u)->Apply(resolutions);
+
+static void BM_BuildImagePyramid8u(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1);
+    const auto &image = cachedFrame8u(width, height);
+    ImagePyramid8u pyramid;
+
+    for (auto _ : state) {
+        buildImagePyramid(image, width, height, 3, pyramid);
+        benchmark::DoNotOptimize(pyramid.levels.data());
+    }
+    state.SetItemsProcessed(state.iterations() * width * height);
+    state.SetBytesProcessed(state.iterations() * width * height);
+}
+BENCHMARK(BM_BuildImagePyramid8u)->Apply(resolutions);
+
+static void BM_LucasKanadeOpticalFlowPyramid8u(benchmark::State &state) {
+    const int width = state.range(0), height = state.range(1), count = state.range(2);
+    const auto &prev = cachedFrame8u(width, height, 0);
+    const auto &next = cachedFrame8u(width, height, 1);
+    const auto features = gridFeatures(width, height, count, 16);
+    std::vector<Vector2f> tracked;
+    std::vector<uint8_t> status;
+    std::vector<float> error;
+
+    for (auto _ : state) {
+        lucasKanadeOpticalFlowPyramid(prev, next, width, height, 3, features, 21, tracked, status, error);
+        benchmark::DoNotOptimize(tracked.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_LucasKanadeOpticalFlowPyramid8u)->Apply(resolutionsAndFeatures);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include "ImageProcessing.h"
+#include "FrameArena.h"
+#include "FrameCache.h"
+#include "StabilizationPipeline.h"
+#include "Trace.h"
+#include "SyntheticImage.h"
+
+struct BenchmarkOptions {
+    int width = 1280;
+    int height = 720;
+    int frames = 60;
+    int levels = 3;
+    int motionLevel = 0;
+    MotionModel motionModel = MotionModel::Affine;
+    int windowSize = 21;
+    double qualityLevel = 0.05;
+    double minimumDistance = 10.0;
+    int gridSize = 0;
+    int maxFeaturesPerTile = 16;
+    float forwardBackwardThreshold = 1.0f;
+    uint32_t seed = 1;
+    bool pipeline = false;
+    int smoothingRadius = 15;
+    int queueCapacity = 4;
+    bool dropOldest = false;
+    double frameBudgetMs = 0;
+    double sourceFps = 0;
+    int streams = 1;
+    int workers = 0;
+};
+
+static void printUsage() {
+    std::cerr << "Usage: StabilizeVideoBenchmark [--width=N] [--height=N] [--frames=N] [--levels=N] [--window=N]\n"
+              << "                               [--quality=X] [--min-distance=X] [--grid=N] [--per-tile=N] [--fb=X] [--seed=N]\n"
+              << "                               [--pipeline=0|1] [--smoothing=N] [--queue=N] [--drop-oldest=0|1]\n"
+              << "                               [--budget=MS] [--fps=X] [--motion-level=N] [--streams=N] [--workers=N]\n"
+              << "                               [--model=translation|similarity|affine|homography]\n"
+              << "  --grid=N selects bucketed detection on an NxN grid, 0 uses goodFeaturesToTrack\n"
+              << "  --pipeline=1 runs the threaded stabilizeVideo pipeline including smoothing and warping,\n"
+              << "    frame synthesis then stands in for decoding and is part of the measurement\n"
+              << "  --budget=MS runs the pipeline in live mode with a per-frame latency budget\n"
+              << "  --fps=X paces the pipeline source like a camera instead of decoding as fast as possible\n"
+              << "  --motion-level=N estimates motion on pyramid level N and rescales it to full resolution\n"
+              << "  --streams=N stabilizes N clips at once through stabilizeBatch on --workers threads\n"
+              << "  --model selects the RANSAC motion model, the camera path is a similarity so translation underfits\n";
+}
+
+static bool parseModel(const std::string &name, MotionModel &model) {
+    if (name == "translation") model = MotionModel::Translation;
+    else if (name == "similarity") model = MotionModel::Similarity;
+    else if (name == "affine") model = MotionModel::Affine;
+    else if (name == "homography") model = MotionModel::Homography;
+    else return false;
+    return true;
+}
+
+static bool parseOptions(int argc, char **argv, BenchmarkOptions &options) {
+    for (int i = 1; i < argc; i++) {
+        const std::string argument = argv[i];
+        const size_t equals = argument.find('=');
+        if (argument.rfind("--", 0) != 0 || equals == std::string::npos) return false;
+
+        const std::string name = argument.substr(2, equals - 2);
+        const std::string value = argument.substr(equals + 1);
+        if (name == "width") options.width = std::stoi(value);
+        else if (name == "height") options.height = std::stoi(value);
+        else if (name == "frames") options.frames = std::stoi(value);
+        else if (name == "levels") options.levels = std::stoi(value);
+        else if (name == "motion-level") options.motionLevel = std::stoi(value);
+        else if (name == "window") options.windowSize = std::stoi(value);
+        else if (name == "quality") options.qualityLevel = std::stod(value);
+        else if (name == "min-distance") options.minimumDistance = std::stod(value);
+        else if (name == "grid") options.gridSize = std::stoi(value);
+        else if (name == "per-tile") options.maxFeaturesPerTile = std::stoi(value);
+        else if (name == "fb") options.forwardBackwardThreshold = std::stof(value);
+        else if (name == "seed") options.seed = std::stoul(value);
+        else if (name == "pipeline") options.pipeline = std::stoi(value) != 0;
+        else if (name == "smoothing") options.smoothingRadius = std::stoi(value);
+        else if (name == "queue") options.queueCapacity = std::stoi(value);
+        else if (name == "drop-oldest") options.dropOldest = std::stoi(value) != 0;
+        else if (name == "budget") options.frameBudgetMs = std::stod(value);
+        else if (name == "fps") options.sourceFps = std::stod(value);
+        else if (name == "streams") options.streams = std::stoi(value);
+        else if (name == "workers") options.workers = std::stoi(value);
+        else if (name == "model") {
+            if (!parseModel(value, options.motionModel)) return false;
+        }
+        else return false;
+    }
+    if (options.frameBudgetMs > 0) options.pipeline = true;
+    return options.frames >= 2 && options.width > 0 && options.height > 0 && options.levels > 0 && options.motionLevel >= 0 && options.streams > 0;
+}
+
+// Camera pose of each frame as a map from image to scene coordinates, a random walk of small shakes around the center
+static std::vector<Eigen::Matrix3d> cameraPath(const BenchmarkOptions &options) {
+    std::mt19937 rng(options.seed);
+    std::normal_distribution<double> shake(0.0, 1.0);
+
+    std::vector<Eigen::Matrix3d> poses(options.frames);
+    double angle = 0, scale = 1, shiftX = 0, shiftY = 0;
+    const double centerX = options.width / 2.0;
+    const double centerY = options.height / 2.0;
+
+    for (int k = 0; k < options.frames; k++) {
+        if (k > 0) {
+            angle += 0.003 * shake(rng);
+            scale *= 1.0 + 0.002 * shake(rng);
+            shiftX += 1.5 * shake(rng);
+            shiftY += 1.5 * shake(rng);
+        }
+
+        const double c = scale * std::cos(angle);
+        const double s = scale * std::sin(angle);
+        poses[k] << c, -s, centerX - c * centerX + s * centerY + shiftX,
+                    s, c, centerY - s * centerX - c * centerY + shiftY,
+                    0, 0, 1;
+    }
+    return poses;
+}
+
+// Mean distance between where the two transforms send the image corners, estimated may be a homography
+static double cornerError(const Eigen::Matrix3d &estimated, const Eigen::Matrix<double, 2, 3> &truth, int width, int height) {
+    double error = 0;
+    for (auto [x, y] : {std::pair{0.0, 0.0}, std::pair{width - 1.0, 0.0}, std::pair{0.0, height - 1.0}, std::pair{width - 1.0, height - 1.0}}) {
+        const Eigen::Vector3d corner(x, y, 1.0);
+        error += ((estimated * corner).hnormalized() - truth * corner).norm();
+    }
+    return error / 4.0;
+}
+
+static double cornerError(const Eigen::Matrix<double, 2, 3> &estimated, const Eigen::Matrix<double, 2, 3> &truth, int width, int height) {
+    Eigen::Matrix3d homogeneous = Eigen::Matrix3d::Identity();
+    homogeneous.topRows<2>() = estimated;
+    return cornerError(homogeneous, truth, width, height);
+}
+
+static double percentile(std::vector<double> samples, double p) {
+    std::sort(samples.begin(), samples.end());
+    const size_t rank = static_cast<size_t>(std::ceil(p * samples.size()));
+    return samples[std::clamp<size_t>(rank, 1, samples.size()) - 1];
+}
+
+struct RunResults {
+    std::vector<double> latencies;
+    std::vector<double> transformErrors;
+    size_t trackedFeatures = 0;
+    double totalMs = 0;
+    StabilizerStatistics statistics;
+};
+
+// Ground truth motion from frame j to frame k
+static Eigen::Matrix<double, 2, 3> trueMotion(const std::vector<Eigen::Matrix3d> &poses, int j, int k) {
+    // A point at p in frame j shows the scene at pose[j] * p, which frame k shows at pose[k]^-1 * pose[j] * p
+    return (poses[k].inverse() * poses[j]).topRows<2>();
+}
+
+// Detection, tracking and estimation one frame pair at a time, the latency of each pair is measured on its own
+static RunResults runSequential(const BenchmarkOptions &options, const std::vector<Eigen::Matrix3d> &poses) {
+    const int width = options.width;
+    const int height = options.height;
+    FrameArena arena;
+    std::vector<Vector2f> prevPts, nextPts;
+    std::vector<uint8_t> status;
+    std::vector<float> error;
+    std::vector<double> motionImage;
+    RunResults results;
+
+    // Full resolution frames go to the cache as they are, otherwise only the motion level is built
+    const auto setFrame = [&](FrameCache &cache, const std::vector<double> &image) {
+        if (options.motionLevel == 0) {
+            cache.setFrame(image, width, height, options.levels);
+            return;
+        }
+        int motionWidth, motionHeight;
+        downscaleImage(image, width, height, options.motionLevel, motionImage, motionWidth, motionHeight, arena);
+        cache.setFrame(motionImage, motionWidth, motionHeight, options.levels);
+    };
+
+    // Each frame is tracked into from its predecessor and then detected on and tracked from, its cache serves all three
+    std::array<FrameCache, 2> caches;
+    setFrame(caches[0], syntheticFrame(width, height, poses[0].topRows<2>(), options.seed));
+    for (int k = 1; k < options.frames; k++) {
+        // Frame synthesis is not part of the measured pipeline
+        auto next = syntheticFrame(width, height, poses[k].topRows<2>(), options.seed);
+        FrameCache &prevCache = caches[(k - 1) % 2];
+        FrameCache &nextCache = caches[k % 2];
+        setTraceFrame(k);
+
+        const auto start = std::chrono::steady_clock::now();
+        arena.reset();
+        setFrame(nextCache, next);
+        if (options.gridSize > 0) {
+            goodFeaturesToTrackBucketed(prevCache, options.qualityLevel, options.minimumDistance, options.gridSize, options.gridSize, options.maxFeaturesPerTile, prevPts, arena);
+        } else {
+            goodFeaturesToTrack(prevCache, options.qualityLevel, options.minimumDistance, prevPts, arena);
+        }
+        lucasKanadeOpticalFlowPyramid(prevCache, nextCache, prevPts, options.windowSize, nextPts, status, error, options.forwardBackwardThreshold);
+        removeRejectedFeatures(prevPts, nextPts, status);
+        // Level coordinates are full resolution ones divided by 2^L, which works for homographies as well
+        const Eigen::Matrix3d levelScale = Eigen::Vector3d(1 << options.motionLevel, 1 << options.motionLevel, 1).asDiagonal();
+        const Eigen::Matrix3d transform = levelScale * estimateMotionModel(prevPts, nextPts, options.motionModel, 1.0f) * levelScale.inverse();
+        const auto end = std::chrono::steady_clock::now();
+
+        const Eigen::Matrix<double, 2, 3> truth = trueMotion(poses, k - 1, k);
+        results.latencies.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+        results.transformErrors.push_back(cornerError(transform, truth, width, height));
+        results.trackedFeatures += prevPts.size();
+    }
+
+    for (double latency : results.latencies) results.totalMs += latency;
+    return results;
+}
+
+static StabilizerOptions stabilizerOptions(const BenchmarkOptions &options) {
+    StabilizerOptions stabilizer;
+    stabilizer.levels = options.levels;
+    stabilizer.motionLevel = options.motionLevel;
+    stabilizer.motionModel = options.motionModel;
+    stabilizer.windowSize = options.windowSize;
+    stabilizer.qualityLevel = options.qualityLevel;
+    stabilizer.minimumDistance = options.minimumDistance;
+    stabilizer.gridSize = options.gridSize;
+    stabilizer.maxFeaturesPerTile = options.maxFeaturesPerTile;
+    stabilizer.forwardBackwardThreshold = options.forwardBackwardThreshold;
+    stabilizer.smoothingRadius = options.smoothingRadius;
+    stabilizer.queueCapacity = options.queueCapacity;
+    stabilizer.overflowPolicy = options.dropOldest ? OverflowPolicy::DropOldest : OverflowPolicy::Block;
+    stabilizer.frameBudgetMs = options.frameBudgetMs;
+    return stabilizer;
+}
+
+// Every stage of stabilizeVideo on its own thread, latency runs from decoding a frame to receiving it stabilized
+static RunResults runPipeline(const BenchmarkOptions &options, const std::vector<Eigen::Matrix3d> &poses) {
+    const StabilizerOptions stabilizer = stabilizerOptions(options);
+    RunResults results;
+    int next = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto source = [&](std::vector<double> &image) {
+        if (next == options.frames) return false;
+        if (options.sourceFps > 0) {
+            std::this_thread::sleep_until(start + std::chrono::duration<double>(next / options.sourceFps));
+        }
+        image = syntheticFrame(options.width, options.height, poses[next].topRows<2>(), options.seed);
+        next++;
+        return true;
+    };
+    // With dropped frames the motion spans from the previously delivered frame
+    int previous = -1;
+    auto sink = [&](int index, const std::vector<double> &, const FrameMotion &motion) {
+        if (previous >= 0) {
+            results.latencies.push_back(motion.latencyMs);
+            results.transformErrors.push_back(cornerError(motion.motion, trueMotion(poses, previous, index), options.width, options.height));
+            results.trackedFeatures += motion.trackedFeatures;
+        }
+        previous = index;
+    };
+
+    results.statistics = stabilizeVideo(options.width, options.height, stabilizer, source, sink);
+    results.totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return results;
+}
+
+// Independent copies of the clip, each with its own texture, sharing the workers of stabilizeBatch
+static RunResults runBatch(const BenchmarkOptions &options, const std::vector<Eigen::Matrix3d> &poses) {
+    const StabilizerOptions stabilizer = stabilizerOptions(options);
+    BatchOptions batch;
+    batch.workerCount = options.workers;
+
+    RunResults results;
+    std::mutex resultsMutex;
+    std::vector<int> next(options.streams, 0);
+    std::vector<StreamJob> jobs(options.streams);
+    for (int stream = 0; stream < options.streams; stream++) {
+        const uint32_t seed = options.seed + stream;
+        jobs[stream].width = options.width;
+        jobs[stream].height = options.height;
+        jobs[stream].source = [&, stream, seed](std::vector<double> &image) {
+            if (next[stream] == options.frames) return false;
+            image = syntheticFrame(options.width, options.height, poses[next[stream]++].topRows<2>(), seed);
+            return true;
+        };
+        jobs[stream].sink = [&](int index, const std::vector<double> &, const FrameMotion &motion) {
+            if (index == 0) return;
+            std::lock_guard lock(resultsMutex);
+            results.latencies.push_back(motion.latencyMs);
+            results.transformErrors.push_back(cornerError(motion.motion, trueMotion(poses, index - 1, index), options.width, options.height));
+            results.trackedFeatures += motion.trackedFeatures;
+        };
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    for (const StabilizerStatistics &statistics : stabilizeBatch(jobs, stabilizer, batch)) {
+        results.statistics.decodedFrames += statistics.decodedFrames;
+    }
+    results.totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return results;
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+#ifdef OPTICAL_FLOW_ENABLE_TRACING
+    TraceRecorder recorder;
+    setTraceSink(&recorder);
+#endif
+
+    const int width = options.width;
+    const int height = options.height;
+    const auto poses = cameraPath(options);
+
+    const RunResults results = options.streams > 1 ? runBatch(options, poses) : options.pipeline ? runPipeline(options, poses) : runSequential(options, poses);
+    const auto &latencies = results.latencies;
+    const auto &transformErrors = results.transformErrors;
+    const size_t trackedFeatures = results.trackedFeatures;
+    const double totalMs = results.totalMs;
+
+    double meanError = 0;
+    for (double transformError : transformErrors) meanError += transformError;
+    meanError /= transformErrors.size();
+
+    rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+
+    const int pairs = latencies.size();
+    std::cout << std::fixed << std::setprecision(3)
+              << "resolution        " << width << "x" << height << "\n"
+              << "frame pairs       " << pairs << "\n"
+              << "features / frame  " << static_cast<double>(trackedFeatures) / pairs << "\n"
+              << "throughput        " << 1000.0 * pairs / totalMs << " fps\n"
+              << "latency p50       " << percentile(latencies, 0.50) << " ms\n"
+              << "latency p99       " << percentile(latencies, 0.99) << " ms\n"
+              << "peak RSS          " << usage.ru_maxrss / 1024.0 << " MiB\n"
+              << "corner error mean " << meanError << " px\n"
+              << "corner error p99  " << percentile(transformErrors, 0.99) << " px\n";
+    if (options.pipeline) std::cout << "dropped frames    " << results.statistics.droppedFrames << "\n";
+    if (options.frameBudgetMs > 0) {
+        const StabilizerStatistics &statistics = results.statistics;
+        std::cout << "deadline misses   " << statistics.deadlineMisses << "\n"
+                  << "skipped detection " << statistics.skippedDetections << "\n"
+                  << "reduced features  " << statistics.reducedFeatures << "\n"
+                  << "dropped levels    " << statistics.droppedPyramidLevels << "\n"
+                  << "reused transforms " << statistics.reusedTransforms << "\n";
+    }
+
+#ifdef OPTICAL_FLOW_ENABLE_TRACING
+    setTraceSink(nullptr);
+    std::cout << "\n";
+    recorder.writeStageSummary(std::cout);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <Eigen/Dense>
+#include "ImageProcessing.h"
+
+// Deterministic pseudo random value in [0, 1] for an integer lattice point
+inline double latticeValue(int x, int y, uint32_t seed) {
+    uint32_t hash = static_cast<uint32_t>(x) * 0x8da6b343u ^ static_cast<uint32_t>(y) * 0xd8163841u ^ seed * 0xcb1ab31fu;
+    hash ^= hash >> 13;
+    hash *= 0x5bd1e995u;
+    hash ^= hash >> 15;
+    return (hash & 0xffffff) / static_cast<double>(0xffffff);
+}
+
+// Smoothly interpolated lattice noise, continuous so frames can be sampled at sub-pixel offsets
+inline double valueNoise(double x, double y, double cellSize, uint32_t seed) {
+    x /= cellSize;
+    y /= cellSize;
+    const double fx = std::floor(x);
+    const double fy = std::floor(y);
+    const int x0 = static_cast<int>(fx);
+    const int y0 = static_cast<int>(fy);
+
+    // Smoothstep weights keep the gradient continuous across cells
+    double ax = x - fx;
+    double ay = y - fy;
+    ax = ax * ax * (3.0 - 2.0 * ax);
+    ay = ay * ay * (3.0 - 2.0 * ay);
+
+    const double top = latticeValue(x0, y0, seed) * (1.0 - ax) + latticeValue(x0 + 1, y0, seed) * ax;
+    const double bottom = latticeValue(x0, y0 + 1, seed) * (1.0 - ax) + latticeValue(x0 + 1, y0 + 1, seed) * ax;
+    return top * (1.0 - ay) + bottom * ay;
+}
+
+// Grayscale textured scene in [0, 1] observed through an affine map, pixel p shows the scene at transform * [p, 1]
+inline std::vector<double> syntheticFrame(int width, int height, const Eigen::Matrix<double, 2, 3> &transform, uint32_t seed = 1) {
+    std::vector<double> image(width * height);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const double sceneX = transform(0, 0) * x + transform(0, 1) * y + transform(0, 2);
+            const double sceneY = transform(1, 0) * x + transform(1, 1) * y + transform(1, 2);
+
+            image[x + y * width] = 0.5 * valueNoise(sceneX, sceneY, 24.0, seed)
+                                 + 0.3 * valueNoise(sceneX, sceneY, 9.0, seed + 1)
+                                 + 0.2 * valueNoise(sceneX, sceneY, 4.0, seed + 2);
+        }
+    }
+
+    return image;
+}
+
+inline std::vector<double> syntheticFrame(int width, int height, double shiftX = 0.0, double shiftY = 0.0, uint32_t seed = 1) {
+    Eigen::Matrix<double, 2, 3> transform {
+        {1.0, 0.0, -shiftX},
+        {0.0, 1.0, -shiftY},
+    };
+    return syntheticFrame(width, height, transform, seed);
+}
+
+// Evenly spread feature locations that keep margin pixels away from the borders
+inline std::vector<Vector2f> gridFeatures(int width, int height, int count, int margin) {
+    const double usableWidth = width - 2.0 * margin;
+    const double usableHeight = height - 2.0 * margin;
+    const int columns = std::max(1, static_cast<int>(std::ceil(std::sqrt(count * usableWidth / usableHeight))));
+    const int rows = (count + columns - 1) / columns;
+
+    std::vector<Vector2f> features;
+    features.reserve(count);
+    for (int i = 0; i < count; i++) {
+        const double x = margin + usableWidth * ((i % columns) + 0.5) / columns;
+        const double y = margin + usableHeight * ((i / columns) + 0.5) / rows;
+        features.push_back({static_cast<float>(x), static_cast<float>(y)});
+    }
+    return features;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "ImageProcessing.h"
+#include "Parallel.h"
+
+// Per-pipeline pool of scratch buffers keyed by element type and size. Buffers handed out stay valid until reset(),
+// which makes every buffer available again for the next frame without returning memory to the allocator.
+class FrameArena {
+public:
+    // Returns a buffer of exactly size elements, its contents are whatever the previous user left behind
+    template <typename T = double>
+    std::vector<T> &acquire(size_t size);
+    ImagePyramid &acquirePyramid();
+
+    // Marks every buffer as free, call once per frame
+    void reset();
+    // Releases all memory held by the arena
+    void clear();
+
+    size_t bytesReserved() const;
+
+private:
+    template <typename T>
+    struct SizeClass {
+        std::vector<std::unique_ptr<std::vector<T>>> buffers;
+        size_t used = 0;
+    };
+
+    template <typename T>
+    using Pool = std::unordered_map<size_t, SizeClass<T>>;
+
+    std::tuple<Pool<double>, Pool<float>, Pool<int32_t>, Pool<int16_t>, Pool<uint8_t>> pools;
+    std::vector<std::unique_ptr<ImagePyramid>> pyramids;
+    size_t pyramidsUsed = 0;
+    mutable std::mutex mutex;
+};
+
+template <typename T>
+std::vector<T> &FrameArena::acquire(size_t size) {
+    std::unique_lock lock(mutex);
+    SizeClass<T> &sizeClass = std::get<Pool<T>>(pools)[size];
+
+    if (sizeClass.used == sizeClass.buffers.size()) {
+        // Pages are placed without the lock, the workers placing them may be running bands that acquire from here
+        lock.unlock();
+        auto buffer = std::make_unique<std::vector<T>>(size);
+        WorkerPool::instance().placePages(buffer->data(), size * sizeof(T));
+        lock.lock();
+        sizeClass.buffers.push_back(std::move(buffer));
+    }
+    return *sizeClass.buffers[sizeClass.used++];
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <vector>
+#include "ImageProcessing.h"
+#include "FrameArena.h"
+
+// Everything derived from one frame that more than one stage consumes: the pyramid, per-level gradients and the
+// structure tensor planes corner detection works on. Each product is computed on first request and kept until the
+// next setFrame(), so a frame that is detected on and then tracked from computes its gradients once.
+// Not synchronized, a cache belongs to one stage at a time.
+class FrameCache {
+public:
+    struct StructureTensor {
+        std::vector<float> Ix2;
+        std::vector<float> IxIy;
+        std::vector<float> Iy2;
+    };
+
+    // Invalidates every cached product, storage is kept for the next frame of the same size
+    void setFrame(const std::vector<double> &image, int width, int height, int levels);
+
+    int width() const { return pyramidLevels.sizes.empty() ? 0 : pyramidLevels.sizes[0].first; }
+    int height() const { return pyramidLevels.sizes.empty() ? 0 : pyramidLevels.sizes[0].second; }
+    int levels() const { return levelCount; }
+
+    // Pyramid levels, plus Sobel gradients of every level when requested
+    const ImagePyramid &pyramid(bool withGradients=true);
+    const std::vector<double> &gradX(int level);
+    const std::vector<double> &gradY(int level);
+    // Structure tensor of level 0 summed over blockSize windows
+    const StructureTensor &structureTensor(int blockSize);
+
+private:
+    void ensureLevels();
+    void ensureGradients(int level);
+
+    ImagePyramid pyramidLevels;
+    std::vector<uint8_t> gradientsReady;
+    int levelCount = 0;
+    int levelsReady = 0;
+    StructureTensor tensor;
+    int tensorBlockSize = 0;
+    FrameArena arena;
+};
@@ -0,0 +1,116 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "SpscQueue.h"
+
+// What the producer does when every slot is in use
+enum class OverflowPolicy {
+    // Wait until the consumer releases a slot, nothing is lost
+    Block,
+    // Reclaim the oldest frame the consumer has not picked up yet, for live sources that must never stall
+    DropOldest,
+};
+
+// Fixed set of preallocated frame slots handed from one producer to one consumer by index. Slots are constructed once
+// and reused, so whatever buffers they own keep their capacity and steady state runs without allocation. Published
+// indices travel through a lock-free ring whose head both sides may advance, the producer only to drop the oldest
+// frame. Released indices return through an SpscQueue. release() may be called by the consumer or by a single
+// downstream thread the consumer hands slots to, but only by one thread.
+template <typename T>
+class FrameRing {
+public:
+    FrameRing(size_t slotCount, OverflowPolicy policy)
+        : cells(std::make_unique<Cell[]>(slotCount)), ready(std::make_unique<std::atomic<uint32_t>[]>(slotCount)),
+          freeSlots(slotCount), slotCount(slotCount), policy(policy) {
+        for (uint32_t i = 0; i < slotCount; i++) {
+            uint32_t slot = i;
+            freeSlots.tryPush(slot);
+        }
+    }
+
+    FrameRing(const FrameRing &) = delete;
+    FrameRing &operator=(const FrameRing &) = delete;
+
+    T &operator[](int slot) { return cells[slot].value; }
+    size_t capacity() const { return slotCount; }
+    uint64_t dropped() const { return droppedFrames.load(std::memory_order_relaxed); }
+
+    // Producer side: a slot to fill, -1 once the ring is closed
+    int acquire() {
+        uint32_t slot;
+        if (freeSlots.tryPop(slot)) return slot;
+        if (policy == OverflowPolicy::DropOldest && dropOldest(slot)) return slot;
+        return freeSlots.pop(slot) ? static_cast<int>(slot) : -1;
+    }
+
+    // Producer side: hands a filled slot to the consumer
+    void publish(int slot) {
+        const uint64_t position = tail.load(std::memory_order_relaxed);
+        ready[position % slotCount].store(slot, std::memory_order_relaxed);
+        tail.store(position + 1, std::memory_order_release);
+        published.fetch_add(1, std::memory_order_release);
+        published.notify_all();
+    }
+
+    // Consumer side: the oldest published slot, -1 once the ring is closed and drained
+    int consume() {
+        while (true) {
+            const uint32_t observed = published.load(std::memory_order_acquire);
+            uint32_t slot;
+            if (tryTake(slot)) return slot;
+            if (closed.load(std::memory_order_acquire)) return tryTake(slot) ? static_cast<int>(slot) : -1;
+            published.wait(observed, std::memory_order_acquire);
+        }
+    }
+
+    // Returns a consumed slot to the producer
+    void release(int slot) {
+        uint32_t freed = slot;
+        freeSlots.tryPush(freed);
+    }
+
+    // Ends the stream from either side, published slots can still be consumed
+    void close() {
+        closed.store(true, std::memory_order_release);
+        freeSlots.close();
+        published.fetch_add(1, std::memory_order_release);
+        published.notify_all();
+    }
+
+private:
+    static constexpr size_t cacheLine = 64;
+
+    // Each slot on its own cache lines so the producer filling one never contends with the consumer reading another
+    struct alignas(cacheLine) Cell {
+        T value;
+    };
+
+    // Claims the entry at head, the value read before the exchange is only trusted if the exchange wins
+    bool tryTake(uint32_t &slot) {
+        uint64_t position = head.load(std::memory_order_acquire);
+        while (position != tail.load(std::memory_order_acquire)) {
+            slot = ready[position % slotCount].load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(position, position + 1, std::memory_order_acq_rel)) return true;
+        }
+        return false;
+    }
+
+    bool dropOldest(uint32_t &slot) {
+        if (!tryTake(slot)) return false;
+        droppedFrames.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    std::unique_ptr<Cell[]> cells;
+    std::unique_ptr<std::atomic<uint32_t>[]> ready;
+    alignas(cacheLine) std::atomic<uint64_t> head = 0;
+    alignas(cacheLine) std::atomic<uint64_t> tail = 0;
+    alignas(cacheLine) std::atomic<uint32_t> published = 0;
+    alignas(cacheLine) std::atomic<bool> closed = false;
+    std::atomic<uint64_t> droppedFrames = 0;
+    SpscQueue<uint32_t> freeSlots;
+    size_t slotCount;
+    OverflowPolicy policy;
+};
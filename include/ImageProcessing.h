@@ -16,17 +16,117 @@ struct Vector2f {
 	friend bool operator>=(const Vector2f& lhs, const Vector2f& rhs) { return !(lhs < rhs); };
 };
 
+class FrameArena;
+class FrameCache;
+
+struct ImagePyramid8u {
+	std::vector<std::vector<uint8_t>> levels;
+	std::vector<std::vector<int16_t>> gradX;
+	std::vector<std::vector<int16_t>> gradY;
+	std::vector<std::pair<int, int>> sizes;
+};
+
+struct ImagePyramid {
+	std::vector<std::vector<double>> levels;
+	std::vector<std::vector<double>> gradX;
+	std::vector<std::vector<double>> gradY;
+	std::vector<std::pair<int, int>> sizes;
+};
+
 std::vector<double> convolveImageKernel(const std::vector<double> &image, int width, int height, int channels, std::vector<std::vector<double>> kernel);
+void convolveImageKernel(const std::vector<double> &image, int width, int height, int channels, const std::vector<std::vector<double>> &kernel, std::vector<double> &output);
 std::vector<double> sobel(const std::vector<double> &image, int width, int height);
 std::vector<double> boxFilter(const std::vector<double> &image, int width, int height, int channels, int boxSize, bool normalize=false);
+void boxFilter(const std::vector<double> &image, int width, int height, int channels, int boxSize, bool normalize, std::vector<double> &output, FrameArena &arena);
+// Dimension of the next pyramid level, odd sizes round up
+int pyramidLevelSize(int size);
 std::vector<double> gaussianPyramid(const std::vector<double> &image, int width, int height, int channels);
+void gaussianPyramid(const std::vector<double> &image, int width, int height, int channels, std::vector<double> &output, FrameArena &arena);
+// Applies gaussianPyramid levels times, output is 1 / 2^levels of the input in each dimension
+void downscaleImage(const std::vector<double> &image, int width, int height, int levels, std::vector<double> &output, int &outputWidth, int &outputHeight, FrameArena &arena);
 std::vector<double> calculateCovarianceMatrix(const std::vector<double> &image, int width, int height, int blockSize);
+void calculateCovarianceMatrix(const std::vector<double> &image, int width, int height, int blockSize, std::vector<double> &output, FrameArena &arena);
+// Structure tensor as separate Ix2 / IxIy / Iy2 planes in float, the layout the SIMD response kernels stream over
+void calculateStructureTensor(const std::vector<double> &image, int width, int height, int blockSize, std::vector<float> &Ix2, std::vector<float> &IxIy, std::vector<float> &Iy2, FrameArena &arena);
+void calculateStructureTensor(const std::vector<double> &gradX, const std::vector<double> &gradY, int width, int height, int blockSize, std::vector<float> &Ix2, std::vector<float> &IxIy, std::vector<float> &Iy2, FrameArena &arena);
+// Response kernels over structure tensor planes, both return the maximum response found in the same pass
+float shiTomasiResponse(const float *Ix2, const float *IxIy, const float *Iy2, int count, float *response);
+float harrisResponse(const float *Ix2, const float *IxIy, const float *Iy2, int count, float sensitivity, float *response);
 std::vector<double> harrisCornerDetector(const std::vector<double> &image, int width, int height, int blockSize, double sensitivity);
+void harrisCornerDetector(const std::vector<double> &image, int width, int height, int blockSize, double sensitivity, std::vector<double> &output, FrameArena &arena);
 std::vector<double> shiTomasiCornerDetector(const std::vector<double> &image, int width, int height, int blockSize);
+void shiTomasiCornerDetector(const std::vector<double> &image, int width, int height, int blockSize, std::vector<double> &output, FrameArena &arena);
 std::vector<double> threshold(const std::vector<double> &image, int width, int height, double threshold);
+void threshold(const std::vector<double> &image, int width, int height, double threshold, std::vector<double> &output);
 std::vector<double> nonMaximalSuppression(const std::vector<double> &image, int width, int height, int blockSize);
+void nonMaximalSuppression(const std::vector<double> &image, int width, int height, int blockSize, std::vector<double> &output);
 std::vector<Vector2f> goodFeaturesToTrack(const std::vector<double> &image, int width, int height, double qualityLevel, double minimumDistance);
+void goodFeaturesToTrack(const std::vector<double> &image, int width, int height, double qualityLevel, double minimumDistance, std::vector<Vector2f> &features, FrameArena &arena);
+// Detection from the structure tensor a frame cache derives from its level 0 gradients
+void goodFeaturesToTrack(FrameCache &frame, double qualityLevel, double minimumDistance, std::vector<Vector2f> &features, FrameArena &arena);
+std::vector<Vector2f> goodFeaturesToTrackBucketed(const std::vector<double> &image, int width, int height, double qualityLevel, double minimumDistance, int gridColumns, int gridRows, int maxFeaturesPerTile);
+void goodFeaturesToTrackBucketed(const std::vector<double> &image, int width, int height, double qualityLevel, double minimumDistance, int gridColumns, int gridRows, int maxFeaturesPerTile, std::vector<Vector2f> &features, FrameArena &arena);
+void goodFeaturesToTrackBucketed(FrameCache &frame, double qualityLevel, double minimumDistance, int gridColumns, int gridRows, int maxFeaturesPerTile, std::vector<Vector2f> &features, FrameArena &arena);
 std::vector<uint8_t> convertImageTo8bit(const std::vector<double> &image, int width, int height, int channels, double gamma=2.2f);
+void convertImageTo8bit(const std::vector<double> &image, int width, int height, int channels, std::vector<uint8_t> &output, double gamma=2.2f);
 std::vector<Vector2f> lucasKanadeOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, const std::vector<Vector2f> &features, int windowSize);
+std::vector<Vector2f> lucasKanadeOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, const std::vector<Vector2f> &features, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold=0.0f);
+void lucasKanadeOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, FrameArena &arena, float forwardBackwardThreshold=0.0f);
 std::vector<Vector2f> lucasKanadeOpticalFlowPyramid(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize);
-Eigen::Matrix<double, 2, 3> estimateAffineTransform(const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts, float reprojectionThreshold);
\ No newline at end of file
+std::vector<Vector2f> lucasKanadeOpticalFlowPyramid(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold=0.0f);
+void lucasKanadeOpticalFlowPyramid(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, FrameArena &arena, float forwardBackwardThreshold=0.0f);
+void buildImagePyramid(const std::vector<double> &image, int width, int height, int levels, ImagePyramid &pyramid, bool computeGradients=true);
+void buildImagePyramid(const std::vector<double> &image, int width, int height, int levels, ImagePyramid &pyramid, FrameArena &arena, bool computeGradients=true);
+ImagePyramid buildImagePyramid(const std::vector<double> &image, int width, int height, int levels, bool computeGradients=true);
+// Sobel gradients normalized by 8 so u & v come out in pixels per frame, borders are reflected
+void spatialGradients(const std::vector<double> &image, int width, int height, std::vector<double> &gradX, std::vector<double> &gradY);
+// prev needs its gradients, next only with a forward backward check. Without them every feature is lost.
+std::vector<Vector2f> lucasKanadeOpticalFlowPyramid(const ImagePyramid &prev, const ImagePyramid &next, const std::vector<Vector2f> &features, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold=0.0f);
+void lucasKanadeOpticalFlowPyramid(const ImagePyramid &prev, const ImagePyramid &next, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold=0.0f);
+// Tracks between two cached frames of the same size, reusing whatever each cache already holds. A positive levels
+// tracks through only that many of the finest levels, trading search range for time.
+void lucasKanadeOpticalFlowPyramid(FrameCache &prev, FrameCache &next, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold=0.0f, int levels=0);
+std::vector<std::vector<Vector2f>> lucasKanadeOpticalFlowBatch(const std::vector<std::vector<double>> &frames, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize, std::vector<std::vector<uint8_t>> &status, float forwardBackwardThreshold=0.0f);
+// Semi-dense flow: pyramidal LK tracks every gridStep-th pixel, tiles of grid points in parallel, and the flow of the
+// pixels in between is interpolated bilinearly. Grid points on untextured ground that LK rejects take the flow of their
+// tracked neighbours. flow receives width * height displacements from prev to next in row-major order.
+std::vector<Vector2f> denseOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, int gridStep=8, int windowSize=9);
+void denseOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, int gridStep, int windowSize, std::vector<Vector2f> &flow, FrameArena &arena);
+// prev needs its gradients, without them the flow is zero. Empty pyramids or frames of different sizes leave flow empty.
+void denseOpticalFlow(const ImagePyramid &prev, const ImagePyramid &next, int gridStep, int windowSize, std::vector<Vector2f> &flow);
+// A positive levels tracks through only that many of the finest levels
+void denseOpticalFlow(FrameCache &prev, FrameCache &next, int gridStep, int windowSize, std::vector<Vector2f> &flow, int levels=0);
+// Rejects features whose backward track does not return within threshold pixels of where it started
+void forwardBackwardCheck(const std::vector<Vector2f> &features, const std::vector<Vector2f> &backTracked, const std::vector<uint8_t> &backStatus, float threshold, std::vector<uint8_t> &status);
+void removeRejectedFeatures(std::vector<Vector2f> &prevPts, std::vector<Vector2f> &nextPts, const std::vector<uint8_t> &status);
+// Motion models of the RANSAC engine in Ransac.h, fewest degrees of freedom first. Smaller models need smaller samples
+// and converge in fewer iterations, so the smallest one that describes the camera motion is the fastest choice.
+enum class MotionModel {
+	Translation,
+	Similarity,
+	Affine,
+	Homography,
+};
+
+// Correspondences a model needs at the very least
+int motionModelSampleSize(MotionModel model);
+// RANSAC fit of model to the correspondences refined on its inliers, as a 3x3 homogeneous matrix. The identity when
+// there are fewer correspondences than the model needs or every sample was degenerate.
+Eigen::Matrix3d estimateMotionModel(const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts, MotionModel model, float reprojectionThreshold);
+Eigen::Matrix<double, 2, 3> estimateAffineTransform(const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts, float reprojectionThreshold);
+Eigen::Matrix3d estimateHomography(const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts, float reprojectionThreshold);
+// Expresses a transform estimated on an image downscaled by scale in the coordinates of the full resolution image
+Eigen::Matrix<double, 2, 3> scaleAffineTransform(const Eigen::Matrix<double, 2, 3> &transform, double scale);
+// Resamples the image so a point p of the input lands on transform * p, uncovered pixels replicate the nearest edge
+std::vector<double> warpAffine(const std::vector<double> &image, int width, int height, const Eigen::Matrix<double, 2, 3> &transform);
+void warpAffine(const std::vector<double> &image, int width, int height, const Eigen::Matrix<double, 2, 3> &transform, std::vector<double> &output);
+
+// Fixed-point pipeline for 8-bit input: int16 Sobel gradients, int32 structure tensor sums over blocks of at most
+// 45x45, float only for the final solve
+void sobelGradients(const std::vector<uint8_t> &image, int width, int height, std::vector<int16_t> &gradX, std::vector<int16_t> &gradY);
+void calculateCovarianceMatrix(const std::vector<uint8_t> &image, int width, int height, int blockSize, std::vector<int32_t> &output);
+void shiTomasiCornerDetector(const std::vector<uint8_t> &image, int width, int height, int blockSize, std::vector<float> &output);
+void gaussianPyramid(const std::vector<uint8_t> &image, int width, int height, std::vector<uint8_t> &output);
+void buildImagePyramid(const std::vector<uint8_t> &image, int width, int height, int levels, ImagePyramid8u &pyramid, bool computeGradients=true);
+void lucasKanadeOpticalFlowPyramid(const ImagePyramid8u &prev, const ImagePyramid8u &next, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold=0.0f);
+void lucasKanadeOpticalFlowPyramid(const std::vector<uint8_t> &prev, const std::vector<uint8_t> &next, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold=0.0f);
\ No newline at end of file
@@ -0,0 +1,112 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Set on threads that already run one of many independent jobs, parallelFor then stays on the calling thread instead of
+// oversubscribing the machine
+inline thread_local bool parallelForInline = false;
+
+// Process wide set of workers, each pinned to one CPU and numbered node by node. Task t of every run goes to worker
+// t % size(), so a stage that splits its rows into size() bands hands band t to the same CPU as the previous stage did
+// and the rows it reads are still in that CPU's caches and on its NUMA node.
+class WorkerPool {
+public:
+    // One worker per CPU the process may run on
+    static WorkerPool &instance();
+
+    explicit WorkerPool(const std::vector<int> &cpus);
+    ~WorkerPool();
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+    // Runs task(t) for every t in [0, taskCount) and waits for all of them, the first exception thrown is rethrown.
+    // The calling thread only waits, tasks never run on it. Runs from several threads may overlap.
+    template <typename Task>
+    void run(int taskCount, Task &task) {
+        run(taskCount, [](void *context, int t) { (*static_cast<Task *>(context))(t); }, &task);
+    }
+
+    // Gives the whole pages of a buffer nobody has written to yet back to the kernel and lets every worker touch its
+    // share of them again, so under the default first touch policy each band lands on the node of the worker that
+    // will fill it. The pages read back as zeros.
+    void placePages(void *data, size_t bytes);
+
+private:
+    using Function = void (*)(void *, int);
+
+    // Lives on the stack of run(). Workers only touch it under the mutex and the last one notifies before unlocking,
+    // so run() cannot return and destroy it while a worker still uses it.
+    struct Batch {
+        std::mutex mutex;
+        std::condition_variable done;
+        int remaining = 0;
+        std::exception_ptr error;
+    };
+
+    struct Task {
+        Function function;
+        void *context;
+        int index;
+        Batch *batch;
+    };
+
+    struct alignas(64) Worker {
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<Task> tasks;
+        bool stopping = false;
+        std::thread thread;
+    };
+
+    void run(int taskCount, Function function, void *context);
+    void work(Worker &worker, int cpu);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+};
+
+// Runs fn(i) for every i in [begin, end), splitting the range into one contiguous band per pool worker. Band t always
+// runs on worker t, so consecutive stages over the same rows keep each band on one CPU.
+template <typename Function>
+void parallelFor(int begin, int end, Function fn) {
+    const int count = end - begin;
+    if (count <= 0) return;
+
+    WorkerPool &pool = WorkerPool::instance();
+    const int bandCount = std::min(count, pool.size());
+    if (bandCount == 1 || parallelForInline) {
+        for (int i = begin; i < end; i++) fn(i);
+        return;
+    }
+
+    const int chunk = (count + bandCount - 1) / bandCount;
+    auto band = [&](int t) {
+        const int bandEnd = std::min(end, begin + (t + 1) * chunk);
+        for (int i = begin + t * chunk; i < bandEnd; i++) fn(i);
+    };
+    pool.run(bandCount, band);
+}
+
+// Resizes a buffer that a parallelFor is about to overwrite, its contents are unspecified afterwards. Fresh storage
+// is spread over the workers' nodes in the same bands parallelFor uses, storage that is already large enough is kept.
+// The fresh capacity is placed while still untouched, so the workers fault its pages in and the zero fill of resize
+// only writes to pages that already sit on their nodes.
+template <typename T>
+void resizeBanded(std::vector<T> &buffer, size_t size) {
+    if (size <= buffer.capacity()) {
+        buffer.resize(size);
+        return;
+    }
+    buffer = std::vector<T>();
+    buffer.reserve(size);
+    WorkerPool::instance().placePages(buffer.data(), size * sizeof(T));
+    buffer.resize(size);
+}
@@ -0,0 +1,411 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <vector>
+#include <Eigen/Dense>
+#include "ImageProcessing.h"
+#include "Parallel.h"
+#include "Simd.h"
+#include "Trace.h"
+
+// Motion models RANSAC can estimate. Each maps points of the previous frame onto the next one as a 3x3 homogeneous
+// matrix and provides fit(), a least squares fit to count >= sampleSize correspondences that returns false on
+// degenerate input. Fitting exactly sampleSize points is the minimal solver LeastSquaresSolver uses. Affine models
+// keep the last row at 0 0 1, so only the homography needs the perspective division when points are transferred.
+struct TranslationModel {
+	static constexpr int sampleSize = 1;
+	static constexpr bool projective = false;
+	static bool fit(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform);
+};
+
+// Rotation, uniform scale and translation
+struct SimilarityModel {
+	static constexpr int sampleSize = 2;
+	static constexpr bool projective = false;
+	static bool fit(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform);
+};
+
+struct AffineModel {
+	static constexpr int sampleSize = 3;
+	static constexpr bool projective = false;
+	static bool fit(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform);
+};
+
+// Normalized DLT, four points are the minimal case
+struct HomographyModel {
+	static constexpr int sampleSize = 4;
+	static constexpr bool projective = true;
+	static bool fit(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform);
+	// Exact homography through four correspondences as an 8x8 linear system with h33 fixed to 1, far cheaper than
+	// the eigen decomposition fit() needs for the general case
+	static bool fitMinimal(const Vector2f *prev, const Vector2f *next, Eigen::Matrix3d &transform);
+};
+
+// Minimal solver and refinement of a model, both its own least squares fit unless a specialization knows better
+template <typename Model>
+struct LeastSquaresSolver {
+	static constexpr int sampleSize = Model::sampleSize;
+
+	static bool minimal(const Vector2f *prev, const Vector2f *next, Eigen::Matrix3d &transform) { return Model::fit(prev, next, sampleSize, transform); }
+	static bool refine(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform) { return Model::fit(prev, next, count, transform); }
+};
+
+template <>
+struct LeastSquaresSolver<HomographyModel> {
+	static constexpr int sampleSize = HomographyModel::sampleSize;
+
+	static bool minimal(const Vector2f *prev, const Vector2f *next, Eigen::Matrix3d &transform) { return HomographyModel::fitMinimal(prev, next, transform); }
+	static bool refine(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform) { return HomographyModel::fit(prev, next, count, transform); }
+};
+
+// Scorers map the squared transfer error of a correspondence to its loss, the hypothesis with the lowest total wins.
+// Losses are never negative, so a hypothesis whose running total has reached the best one can stop being scored. The
+// SimdFloat overload scores SimdFloat::width correspondences at once.
+
+// Classic RANSAC, every outlier costs the same and inliers are free
+struct InlierCountScorer {
+	static double loss(double sqError, double sqThreshold) { return sqError < sqThreshold ? 0.0 : 1.0; }
+	static SimdFloat loss(SimdFloat sqError, SimdFloat sqThreshold) { return SimdFloat::broadcast(1.0f) - lessThan(sqError, sqThreshold); }
+};
+
+// MSAC truncated quadratic: inliers cost their squared error and outliers the squared threshold, so among hypotheses
+// with similar support the one fitting its inliers more tightly wins
+struct MsacScorer {
+	static double loss(double sqError, double sqThreshold) { return std::min(sqError, sqThreshold); }
+	static SimdFloat loss(SimdFloat sqError, SimdFloat sqThreshold) { return min(sqError, sqThreshold); }
+};
+
+struct RansacOptions {
+	// Correspondences transferred within this many pixels of their match are inliers
+	double threshold = 1.0;
+	// Stop once a hypothesis this likely to come from an all inlier sample has been seen
+	double confidence = 0.99;
+	int maxIterations = 1000;
+	// Refit the best hypothesis to all of its inliers
+	bool refine = true;
+	// Score rounds of hypotheses in parallel, one per pool worker, once there are this many correspondences. Fewer
+	// are scored faster than a round trip through the pool takes.
+	int parallelMinimumPoints = 2000;
+	// Preemptive RANSAC when positive: this many hypotheses are drawn up front and scored together on blocks of
+	// preemptiveBlock correspondences in random order, dropping the worse half after every block. The work is then
+	// bounded by the batch instead of growing with the correspondences and the iterations the data needs, at the price
+	// of the confidence guarantee, so the batch has to cover the worst outlier ratio expected.
+	int preemptiveHypotheses = 0;
+	int preemptiveBlock = 100;
+};
+
+struct RansacResult {
+	Eigen::Matrix3d transform = Eigen::Matrix3d::Identity();
+	int inliers = 0;
+	// Total loss of transform under the scorer
+	double cost = 0;
+	// Samples drawn, degenerate ones included
+	int iterations = 0;
+	// False when no sample gave a hypothesis, transform is then the identity
+	bool found = false;
+};
+
+// Squared distance between transform * p and q
+template <typename Model>
+inline double transferError(const Eigen::Matrix3d &transform, const Vector2f &p, const Vector2f &q) {
+    double x = transform(0, 0) * p.x + transform(0, 1) * p.y + transform(0, 2);
+    double y = transform(1, 0) * p.x + transform(1, 1) * p.y + transform(1, 2);
+    if constexpr (Model::projective) {
+        const double w = transform(2, 0) * p.x + transform(2, 1) * p.y + transform(2, 2);
+        if (std::abs(w) < 1e-12) return std::numeric_limits<double>::infinity();
+        x /= w;
+        y /= w;
+    }
+    const double dx = x - q.x;
+    const double dy = y - q.y;
+    return dx * dx + dy * dy;
+}
+
+// Iterations after which a sample of sampleSize points drawn from data with this inlier ratio has been all inliers at
+// least once with the given confidence
+inline int ransacIterations(double inlierRatio, int sampleSize, double confidence, int maxIterations) {
+    const double allInliers = std::pow(inlierRatio, sampleSize);
+    if (allInliers >= 1.0) return 1;
+    if (allInliers <= 0.0) return maxIterations;
+    const double iterations = std::ceil(std::log(1.0 - confidence) / std::log(1.0 - allInliers));
+    return static_cast<int>(std::clamp(iterations, 1.0, static_cast<double>(maxIterations)));
+}
+
+// Hypothesize and verify over the correspondences prev[i] -> next[i]. Solver turns samples into hypotheses of Model
+// and refits the winner to its inliers, Scorer ranks them. Samples are drawn until the best hypothesis so far makes
+// further ones unlikely to improve on it, so smaller models and cleaner data take fewer iterations. Scoring a
+// hypothesis stops as soon as its loss reaches that of the best one, which it then can no longer beat. On enough
+// correspondences hypotheses are drawn in rounds of one per pool worker and scored in parallel, each against the best
+// of the previous rounds. Rounds are merged in the order they were drawn. With RansacOptions::preemptiveHypotheses
+// set, a fixed batch is pruned breadth first instead, see preemptive(). Hypotheses are scored in single precision
+// against coordinate planes copied from the correspondences once per estimate, SimdFloat::width at a time.
+template <typename Model, typename Solver = LeastSquaresSolver<Model>, typename Scorer = MsacScorer>
+class Ransac {
+public:
+    explicit Ransac(const RansacOptions &options = {}) : options(options), generator(std::random_device{}()) {}
+
+    void setOptions(const RansacOptions &value) { options = value; }
+
+    // inlierMask receives the inliers of the returned transform when given
+    RansacResult estimate(const std::vector<Vector2f> &prev, const std::vector<Vector2f> &next, std::vector<uint8_t> *inlierMask = nullptr) {
+        constexpr int sampleSize = Solver::sampleSize;
+        TRACE_SCOPE(trace, "ransac", 2 * prev.size() * sizeof(Vector2f));
+        TRACE_FEATURES(trace, prev.size());
+
+        RansacResult result;
+        const int count = prev.size();
+        if (inlierMask) inlierMask->assign(count, 0);
+        if (count < sampleSize) return result;
+
+        const double sqThreshold = options.threshold * options.threshold;
+        loadPlanes(prev, next);
+        if (options.preemptiveHypotheses > 0) {
+            preemptive(prev, next, sqThreshold, result);
+        } else {
+            adaptive(prev, next, sqThreshold, result);
+        }
+        if (!result.found) {
+            result.cost = 0;
+            return result;
+        }
+
+        if (options.refine && result.inliers > sampleSize) {
+            // Every correspondence is written and only inliers advance the end, which keeps the loop free of branches
+            // the outliers would mispredict. The test reads the planes, not the slot just written, so iterations do not
+            // wait on each other.
+            inlierPrev.resize(count);
+            inlierNext.resize(count);
+            int inliers = 0;
+            for (int i = 0; i < count; i++) {
+                const Vector2f p {prevX[i], prevY[i]}, q {nextX[i], nextY[i]};
+                inlierPrev[inliers] = p;
+                inlierNext[inliers] = q;
+                inliers += transferError<Model>(result.transform, p, q) < sqThreshold;
+            }
+            // The least squares fit replaces the sample's unless it scores worse
+            Eigen::Matrix3d refined;
+            if (Solver::refine(inlierPrev.data(), inlierNext.data(), inliers, refined)) {
+                const Score refinedScore = score(refined, 0, count, sqThreshold, std::numeric_limits<double>::infinity());
+                if (refinedScore.cost <= result.cost) {
+                    result.cost = refinedScore.cost;
+                    result.inliers = refinedScore.inliers;
+                    result.transform = refined;
+                }
+            }
+        }
+
+        if (inlierMask) {
+            for (int i = 0; i < count; i++) (*inlierMask)[i] = transferError<Model>(result.transform, prev[i], next[i]) < sqThreshold;
+        }
+        return result;
+    }
+
+private:
+    struct Score {
+        double cost;
+        int inliers;
+    };
+
+    // Correspondences scored between checks against the bound, the check is too branchy to run on every one
+    static constexpr int scoringBlock = 64;
+
+    // Copies the correspondences into the coordinate planes score() reads
+    void loadPlanes(const std::vector<Vector2f> &prev, const std::vector<Vector2f> &next) {
+        const int count = prev.size();
+        prevX.resize(count);
+        prevY.resize(count);
+        nextX.resize(count);
+        nextY.resize(count);
+        for (int i = 0; i < count; i++) {
+            prevX[i] = prev[i].x;
+            prevY[i] = prev[i].y;
+            nextX[i] = next[i].x;
+            nextY[i] = next[i].y;
+        }
+    }
+
+    // Moves a uniformly drawn subset of the correspondences to the front of the planes, the first steps of a Fisher
+    // Yates shuffle. The order behind it does not matter to any score.
+    void shufflePrefix(int prefix) {
+        const int count = prevX.size();
+        for (int i = 0; i < prefix; i++) {
+            const int j = std::uniform_int_distribution<int>(i, count - 1)(generator);
+            std::swap(prevX[i], prevX[j]);
+            std::swap(prevY[i], prevY[j]);
+            std::swap(nextX[i], nextX[j]);
+            std::swap(nextY[i], nextY[j]);
+        }
+    }
+
+    // One sample of distinct correspondences through the minimal solver, false when it was degenerate
+    bool draw(const std::vector<Vector2f> &prev, const std::vector<Vector2f> &next, Eigen::Matrix3d &hypothesis) {
+        constexpr int sampleSize = Solver::sampleSize;
+        std::uniform_int_distribution<int> pick(0, static_cast<int>(prev.size()) - 1);
+        Vector2f samplePrev[sampleSize], sampleNext[sampleSize];
+        int sample[sampleSize];
+        // Distinct indices, rejection is cheap with samples this small
+        for (int s = 0; s < sampleSize; s++) {
+            do sample[s] = pick(generator);
+            while (std::find(sample, sample + s, sample[s]) != sample + s);
+            samplePrev[s] = prev[sample[s]];
+            sampleNext[s] = next[sample[s]];
+        }
+        return Solver::minimal(samplePrev, sampleNext, hypothesis);
+    }
+
+    void adaptive(const std::vector<Vector2f> &prev, const std::vector<Vector2f> &next, double sqThreshold, RansacResult &result) {
+        const int count = prev.size();
+        const int roundSize = count >= options.parallelMinimumPoints && !parallelForInline ? WorkerPool::instance().size() : 1;
+        std::vector<Eigen::Matrix3d> hypotheses(roundSize);
+        std::vector<Score> scores(roundSize);
+
+        result.cost = std::numeric_limits<double>::infinity();
+        int iterations = options.maxIterations;
+        while (result.iterations < iterations) {
+            int drawn = 0;
+            while (drawn < roundSize && result.iterations < iterations) {
+                result.iterations++;
+                if (draw(prev, next, hypotheses[drawn])) drawn++;
+            }
+
+            const double bound = result.cost;
+            if (drawn == 1) {
+                scores[0] = score(hypotheses[0], 0, count, sqThreshold, bound);
+            } else {
+                parallelFor(0, drawn, [&](int h) { scores[h] = score(hypotheses[h], 0, count, sqThreshold, bound); });
+            }
+
+            for (int h = 0; h < drawn; h++) {
+                if (scores[h].cost >= result.cost) continue;
+                result.cost = scores[h].cost;
+                result.inliers = scores[h].inliers;
+                result.transform = hypotheses[h];
+                result.found = true;
+                iterations = ransacIterations(static_cast<double>(result.inliers) / count, Solver::sampleSize, options.confidence, options.maxIterations);
+            }
+        }
+    }
+
+    // Nister's preemptive RANSAC: the whole batch is scored on the first block of the shuffled correspondences and
+    // halved after every further block until one hypothesis is left, which is then scored on the rest. A block costs
+    // the same whatever the number of correspondences, so only the final scoring grows with it. Surviving hypotheses
+    // of a block are scored in parallel once the block holds enough work.
+    void preemptive(const std::vector<Vector2f> &prev, const std::vector<Vector2f> &next, double sqThreshold, RansacResult &result) {
+        const int count = prev.size();
+        const int batch = options.preemptiveHypotheses;
+        std::vector<Eigen::Matrix3d> hypotheses;
+        hypotheses.reserve(batch);
+        // Degenerate samples do not count towards the batch, maxIterations caps the draws on data full of them
+        const int maxDraws = std::max(options.maxIterations, batch);
+        Eigen::Matrix3d hypothesis;
+        while (static_cast<int>(hypotheses.size()) < batch && result.iterations < maxDraws) {
+            result.iterations++;
+            if (draw(prev, next, hypothesis)) hypotheses.push_back(hypothesis);
+        }
+        if (hypotheses.empty()) return;
+
+        // Blocks have to be random subsets, but only those scored before a single hypothesis is left
+        const int block = std::max(options.preemptiveBlock, 1);
+        const int halvings = std::bit_width(hypotheses.size() - 1);
+        shufflePrefix(static_cast<int>(std::min<int64_t>(static_cast<int64_t>(halvings) * block, count)));
+
+        std::vector<Score> scores(hypotheses.size(), Score {0.0, 0});
+        std::vector<int> alive(hypotheses.size());
+        std::iota(alive.begin(), alive.end(), 0);
+        // Lower cost first, ties go to the earlier draw so the outcome only depends on the seed
+        auto better = [&](int a, int b) { return scores[a].cost < scores[b].cost || (scores[a].cost == scores[b].cost && a < b); };
+
+        int scored = 0;
+        auto scoreAlive = [&](int end) {
+            const int begin = scored;
+            auto scoreOne = [&](int h) {
+                const Score partial = score(hypotheses[alive[h]], begin, end, sqThreshold, std::numeric_limits<double>::infinity());
+                scores[alive[h]].cost += partial.cost;
+                scores[alive[h]].inliers += partial.inliers;
+            };
+            const int survivors = alive.size();
+            if (survivors > 1 && static_cast<int64_t>(survivors) * (end - begin) >= options.parallelMinimumPoints) {
+                parallelFor(0, survivors, scoreOne);
+            } else {
+                for (int h = 0; h < survivors; h++) scoreOne(h);
+            }
+            scored = end;
+        };
+
+        while (alive.size() > 1 && scored < count) {
+            scoreAlive(std::min(scored + block, count));
+            const int keep = alive.size() / 2;
+            std::nth_element(alive.begin(), alive.begin() + keep, alive.end(), better);
+            alive.resize(keep);
+        }
+        const int best = *std::min_element(alive.begin(), alive.end(), better);
+        alive.assign(1, best);
+        if (scored < count) scoreAlive(count);
+
+        result.transform = hypotheses[best];
+        result.cost = scores[best].cost;
+        result.inliers = scores[best].inliers;
+        result.found = true;
+    }
+
+    // Total loss of a hypothesis over the correspondences [begin, end) of the planes, abandoned with a cost of at least
+    // bound once it can no longer come in below it
+    Score score(const Eigen::Matrix3d &transform, int begin, int end, double sqThreshold, double bound) const {
+        constexpr int width = SimdFloat::width;
+        const SimdFloat h00 = SimdFloat::broadcast(transform(0, 0)), h01 = SimdFloat::broadcast(transform(0, 1)), h02 = SimdFloat::broadcast(transform(0, 2));
+        const SimdFloat h10 = SimdFloat::broadcast(transform(1, 0)), h11 = SimdFloat::broadcast(transform(1, 1)), h12 = SimdFloat::broadcast(transform(1, 2));
+        const SimdFloat h20 = SimdFloat::broadcast(transform(2, 0)), h21 = SimdFloat::broadcast(transform(2, 1)), h22 = SimdFloat::broadcast(transform(2, 2));
+        const SimdFloat threshold = SimdFloat::broadcast(sqThreshold);
+
+        Score total {0.0, 0};
+        for (int blockBegin = begin; blockBegin < end && total.cost < bound; blockBegin += scoringBlock) {
+            const int blockEnd = std::min(blockBegin + scoringBlock, end);
+            SimdFloat cost = SimdFloat::broadcast(0.0f);
+            SimdFloat inliers = SimdFloat::broadcast(0.0f);
+            int i = blockBegin;
+            for (; i + width <= blockEnd; i += width) {
+                const SimdFloat px = SimdFloat::load(&prevX[i]);
+                const SimdFloat py = SimdFloat::load(&prevY[i]);
+                SimdFloat x = h00 * px + h01 * py + h02;
+                SimdFloat y = h10 * px + h11 * py + h12;
+                if constexpr (Model::projective) {
+                    // Points mapped to infinity come out as inf or NaN, both of which score as outliers
+                    const SimdFloat w = h20 * px + h21 * py + h22;
+                    x = x / w;
+                    y = y / w;
+                }
+                const SimdFloat dx = x - SimdFloat::load(&nextX[i]);
+                const SimdFloat dy = y - SimdFloat::load(&nextY[i]);
+                const SimdFloat sqError = dx * dx + dy * dy;
+                cost = cost + Scorer::loss(sqError, threshold);
+                inliers = inliers + lessThan(sqError, threshold);
+            }
+            total.cost += cost.reduceSum();
+            total.inliers += static_cast<int>(inliers.reduceSum());
+            for (; i < blockEnd; i++) {
+                const double sqError = transferError<Model>(transform, Vector2f {prevX[i], prevY[i]}, Vector2f {nextX[i], nextY[i]});
+                total.cost += Scorer::loss(sqError, sqThreshold);
+                total.inliers += sqError < sqThreshold;
+            }
+        }
+        return total;
+    }
+
+    RansacOptions options;
+    std::mt19937 generator;
+    // Correspondences as coordinate planes in scoring order and the inliers gathered for refinement, kept between
+    // estimates to reuse their storage
+    SimdVector<float> prevX, prevY, nextX, nextY;
+    std::vector<Vector2f> inlierPrev, inlierNext;
+};
+
+// One estimate with MSAC scoring
+template <typename Model>
+RansacResult ransac(const std::vector<Vector2f> &prev, const std::vector<Vector2f> &next, const RansacOptions &options, std::vector<uint8_t> *inlierMask = nullptr) {
+    return Ransac<Model>(options).estimate(prev, next, inlierMask);
+}
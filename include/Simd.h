@@ -0,0 +1,127 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Thin wrapper over the widest float vector the compile target supports. Kernels written against it
+// process SimdFloat::width lanes per step and fall back to a single lane on targets without SSE2.
+// lessThan yields 1 in the lanes where a < b and 0 elsewhere, NaN compares false.
+struct SimdFloat {
+#if defined(__AVX2__)
+    static constexpr int width = 8;
+    __m256 value;
+
+    static SimdFloat load(const float *p) { return {_mm256_loadu_ps(p)}; }
+    static SimdFloat broadcast(float x) { return {_mm256_set1_ps(x)}; }
+    void store(float *p) const { _mm256_storeu_ps(p, value); }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { return {_mm256_add_ps(a.value, b.value)}; }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { return {_mm256_sub_ps(a.value, b.value)}; }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { return {_mm256_mul_ps(a.value, b.value)}; }
+    friend SimdFloat operator/(SimdFloat a, SimdFloat b) { return {_mm256_div_ps(a.value, b.value)}; }
+    friend SimdFloat sqrt(SimdFloat a) { return {_mm256_sqrt_ps(a.value)}; }
+    friend SimdFloat min(SimdFloat a, SimdFloat b) { return {_mm256_min_ps(a.value, b.value)}; }
+    friend SimdFloat max(SimdFloat a, SimdFloat b) { return {_mm256_max_ps(a.value, b.value)}; }
+    friend SimdFloat abs(SimdFloat a) { return {_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.value)}; }
+    friend SimdFloat lessThan(SimdFloat a, SimdFloat b) { return {_mm256_and_ps(_mm256_cmp_ps(a.value, b.value, _CMP_LT_OQ), _mm256_set1_ps(1.0f))}; }
+
+    float reduceMax() const {
+        __m128 half = _mm_max_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+        half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+        half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+        return _mm_cvtss_f32(half);
+    }
+
+    float reduceSum() const {
+        __m128 half = _mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+        half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+        half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+        return _mm_cvtss_f32(half);
+    }
+#elif defined(__SSE2__)
+    static constexpr int width = 4;
+    __m128 value;
+
+    static SimdFloat load(const float *p) { return {_mm_loadu_ps(p)}; }
+    static SimdFloat broadcast(float x) { return {_mm_set1_ps(x)}; }
+    void store(float *p) const { _mm_storeu_ps(p, value); }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { return {_mm_add_ps(a.value, b.value)}; }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { return {_mm_sub_ps(a.value, b.value)}; }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { return {_mm_mul_ps(a.value, b.value)}; }
+    friend SimdFloat operator/(SimdFloat a, SimdFloat b) { return {_mm_div_ps(a.value, b.value)}; }
+    friend SimdFloat sqrt(SimdFloat a) { return {_mm_sqrt_ps(a.value)}; }
+    friend SimdFloat min(SimdFloat a, SimdFloat b) { return {_mm_min_ps(a.value, b.value)}; }
+    friend SimdFloat max(SimdFloat a, SimdFloat b) { return {_mm_max_ps(a.value, b.value)}; }
+    friend SimdFloat abs(SimdFloat a) { return {_mm_andnot_ps(_mm_set1_ps(-0.0f), a.value)}; }
+    friend SimdFloat lessThan(SimdFloat a, SimdFloat b) { return {_mm_and_ps(_mm_cmplt_ps(a.value, b.value), _mm_set1_ps(1.0f))}; }
+
+    float reduceMax() const {
+        __m128 folded = _mm_max_ps(value, _mm_movehl_ps(value, value));
+        folded = _mm_max_ss(folded, _mm_shuffle_ps(folded, folded, 1));
+        return _mm_cvtss_f32(folded);
+    }
+
+    float reduceSum() const {
+        __m128 folded = _mm_add_ps(value, _mm_movehl_ps(value, value));
+        folded = _mm_add_ss(folded, _mm_shuffle_ps(folded, folded, 1));
+        return _mm_cvtss_f32(folded);
+    }
+#else
+    static constexpr int width = 1;
+    float value;
+
+    static SimdFloat load(const float *p) { return {*p}; }
+    static SimdFloat broadcast(float x) { return {x}; }
+    void store(float *p) const { *p = value; }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { return {a.value + b.value}; }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { return {a.value - b.value}; }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { return {a.value * b.value}; }
+    friend SimdFloat operator/(SimdFloat a, SimdFloat b) { return {a.value / b.value}; }
+    friend SimdFloat sqrt(SimdFloat a) { return {std::sqrt(a.value)}; }
+    // Second operand when either is NaN, like minps and maxps
+    friend SimdFloat min(SimdFloat a, SimdFloat b) { return {a.value < b.value ? a.value : b.value}; }
+    friend SimdFloat max(SimdFloat a, SimdFloat b) { return {a.value > b.value ? a.value : b.value}; }
+    friend SimdFloat abs(SimdFloat a) { return {std::abs(a.value)}; }
+    friend SimdFloat lessThan(SimdFloat a, SimdFloat b) { return {a.value < b.value ? 1.0f : 0.0f}; }
+
+    float reduceMax() const { return value; }
+    float reduceSum() const { return value; }
+#endif
+};
+
+// Allocates on cache line boundaries, which covers the alignment of every SimdFloat width. Buffers whose rows are
+// padded to a multiple of SimdFloat::width then start every row on a vector boundary.
+template <typename T>
+struct SimdAllocator {
+    using value_type = T;
+    static constexpr std::align_val_t alignment {64};
+
+    SimdAllocator() = default;
+    template <typename U>
+    SimdAllocator(const SimdAllocator<U> &) {}
+
+    T *allocate(size_t count) { return static_cast<T *>(::operator new(count * sizeof(T), alignment)); }
+    void deallocate(T *pointer, size_t) { ::operator delete(pointer, alignment); }
+
+    template <typename U>
+    bool operator==(const SimdAllocator<U> &) const { return true; }
+};
+
+template <typename T>
+using SimdVector = std::vector<T, SimdAllocator<T>>;
+
+// Smallest multiple of SimdFloat::width that holds count floats
+inline int simdPadded(int count) {
+    return (count + SimdFloat::width - 1) / SimdFloat::width * SimdFloat::width;
+}
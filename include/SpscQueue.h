@@ -0,0 +1,88 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Bounded single-producer single-consumer queue. The fast path is one acquire load and one release store per side on
+// monotonic head / tail counters that live on separate cache lines. Blocking calls only sleep when the queue is full
+// or empty, on a counter the other side bumps after every operation.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity) {}
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    size_t capacity() const { return slots.size(); }
+    size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+
+    // Producer side, moves from value only when there was room
+    bool tryPush(T &value) {
+        const size_t position = tail.load(std::memory_order_relaxed);
+        if (position - head.load(std::memory_order_acquire) == slots.size()) return false;
+
+        slots[position % slots.size()] = std::move(value);
+        tail.store(position + 1, std::memory_order_release);
+        signal(pushed);
+        return true;
+    }
+
+    // Consumer side
+    bool tryPop(T &value) {
+        const size_t position = head.load(std::memory_order_relaxed);
+        if (position == tail.load(std::memory_order_acquire)) return false;
+
+        value = std::move(slots[position % slots.size()]);
+        head.store(position + 1, std::memory_order_release);
+        signal(popped);
+        return true;
+    }
+
+    // Waits for room, returns false without pushing once the queue is closed
+    bool push(T value) {
+        while (!closed.load(std::memory_order_acquire)) {
+            const uint32_t observed = popped.load(std::memory_order_acquire);
+            if (tryPush(value)) return true;
+            popped.wait(observed, std::memory_order_acquire);
+        }
+        return false;
+    }
+
+    // Waits for an element, returns false once the queue is closed and drained
+    bool pop(T &value) {
+        while (true) {
+            const uint32_t observed = pushed.load(std::memory_order_acquire);
+            if (tryPop(value)) return true;
+            if (closed.load(std::memory_order_acquire)) return tryPop(value);
+            pushed.wait(observed, std::memory_order_acquire);
+        }
+    }
+
+    // Ends the stream, elements already queued can still be popped
+    void close() {
+        closed.store(true, std::memory_order_release);
+        signal(pushed);
+        signal(popped);
+    }
+
+    bool isClosed() const { return closed.load(std::memory_order_acquire); }
+
+private:
+    static void signal(std::atomic<uint32_t> &counter) {
+        counter.fetch_add(1, std::memory_order_release);
+        counter.notify_all();
+    }
+
+    static constexpr size_t cacheLine = 64;
+
+    alignas(cacheLine) std::atomic<size_t> head = 0;
+    alignas(cacheLine) std::atomic<uint32_t> popped = 0;
+    alignas(cacheLine) std::atomic<size_t> tail = 0;
+    alignas(cacheLine) std::atomic<uint32_t> pushed = 0;
+    alignas(cacheLine) std::atomic<bool> closed = false;
+    std::vector<T> slots;
+};
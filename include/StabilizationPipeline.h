@@ -0,0 +1,111 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <Eigen/Dense>
+#include "ImageProcessing.h"
+#include "FrameRing.h"
+
+struct StabilizerOptions {
+	int levels = 3;
+	// Detection, tracking and estimation run on this pyramid level, 0 is full resolution. The motion is rescaled so
+	// smoothing and warping still work on full resolution frames. Window size and minimum distance are in pixels of
+	// that level.
+	int motionLevel = 0;
+	int windowSize = 21;
+	double qualityLevel = 0.05;
+	double minimumDistance = 10.0;
+	// Bucketed detection on a gridSize x gridSize grid, 0 uses goodFeaturesToTrack
+	int gridSize = 4;
+	int maxFeaturesPerTile = 16;
+	float forwardBackwardThreshold = 1.0f;
+	float reprojectionThreshold = 1.0f;
+	// Frame to frame motion model, the smallest one that fits the footage converges fastest. Smoothing and warping are
+	// affine, so Homography is estimated as Affine.
+	MotionModel motionModel = MotionModel::Affine;
+	// Frames on either side averaged into the smoothed camera path
+	int smoothingRadius = 15;
+	// Frame slots beyond those the stages hold themselves, decoding can run this far ahead of the slowest stage
+	int queueCapacity = 4;
+	// What decoding does once every slot is in use, DropOldest suits live sources that must never stall
+	OverflowPolicy overflowPolicy = OverflowPolicy::Block;
+	// Live mode when positive: budget of each frame from the source delivering it to the sink receiving it. Smoothing
+	// becomes causal and frames that would overrun walk down the degradation ladder instead of arriving late.
+	double frameBudgetMs = 0;
+};
+
+// Rungs of the live mode degradation ladder, cheapest loss of quality first, combined as bits in FrameMotion
+enum class Degradation : uint32_t {
+	// Track the points that survived the previous pair instead of detecting afresh
+	SkipDetection = 1 << 0,
+	// Track every other point
+	ReduceFeatures = 1 << 1,
+	// Leave out the coarsest pyramid level, shortening the search range
+	DropPyramidLevel = 1 << 2,
+	// No tracking or estimation, the previous frame's motion stands in
+	ReuseTransform = 1 << 3,
+};
+
+struct FrameMotion {
+	// Maps points of the previous frame into this one, identity for the first frame
+	Eigen::Matrix<double, 2, 3> motion = Eigen::Matrix<double, 2, 3>::Identity();
+	// Applied by the warp stage to move the frame onto the smoothed path
+	Eigen::Matrix<double, 2, 3> correction = Eigen::Matrix<double, 2, 3>::Identity();
+	int trackedFeatures = 0;
+	// Degradation bits applied to this frame
+	uint32_t degradations = 0;
+	// From the source delivering the frame to the hand-off to the sink
+	double latencyMs = 0;
+
+	bool degraded(Degradation degradation) const { return degradations & static_cast<uint32_t>(degradation); }
+};
+
+struct StabilizerStatistics {
+	int decodedFrames = 0;
+	// Frames a DropOldest ring discarded before they were processed
+	uint64_t droppedFrames = 0;
+	// Live mode telemetry: how often each rung fired and how many frames still missed their budget
+	uint64_t skippedDetections = 0;
+	uint64_t reducedFeatures = 0;
+	uint64_t droppedPyramidLevels = 0;
+	uint64_t reusedTransforms = 0;
+	uint64_t deadlineMisses = 0;
+};
+
+// Fills image with the next width x height grayscale frame, returns false at the end of the stream
+using FrameSource = std::function<bool(std::vector<double> &image)>;
+// Receives stabilized frames in order on the thread that called stabilizeVideo
+using FrameSink = std::function<void(int index, const std::vector<double> &image, const FrameMotion &motion)>;
+
+// Runs decode, pyramid, detect / track, estimate, smooth, warp and encode as pipelined stages, each on its own thread.
+// Frames live in a fixed ring of preallocated slots whose indices move between stages over bounded SPSC queues, so
+// throughput approaches the cost of the slowest stage rather than their sum and steady state does not allocate. The
+// first exception thrown by the source, the sink or any stage is rethrown once every stage has stopped.
+StabilizerStatistics stabilizeVideo(int width, int height, const StabilizerOptions &options, const FrameSource &source, const FrameSink &sink);
+
+// One clip of a batch. Source and sink are called from whichever worker runs the stream, but never concurrently.
+struct StreamJob {
+	int width = 0;
+	int height = 0;
+	FrameSource source;
+	FrameSink sink;
+};
+
+struct BatchOptions {
+	// Workers shared by all streams, 0 starts one per CPU the process may run on
+	int workerCount = 0;
+	// Streams holding buffers at once, 0 allows two per worker. Later jobs wait until an earlier one finishes.
+	int maxActiveStreams = 0;
+	// Frames a stream runs before its worker moves on to the next stream in its queue
+	int framesPerTurn = 8;
+	// Pin every worker to the CPUs of one NUMA node, round robin over the nodes
+	bool pinWorkers = true;
+};
+
+// Stabilizes many independent clips in one process on a shared pool of workers. Every worker has its own queue of
+// streams and, once it runs dry, admits the next job or steals a stream, from workers on its own node first. A stream
+// runs the stages of stabilizeVideo one frame at a time on one worker and borrows its frame caches and buffers from a
+// pool per NUMA node, so they are reused by the next stream instead of being allocated for every clip. Live mode does
+// not apply, frameBudgetMs is ignored. Returns the statistics of every job in order, the first exception thrown by a
+// source or sink is rethrown once all workers have stopped.
+std::vector<StabilizerStatistics> stabilizeBatch(const std::vector<StreamJob> &jobs, const StabilizerOptions &options, const BatchOptions &batch = {});
@@ -0,0 +1,9 @@
+#pragma once
+#include <vector>
+
+// CPUs of every NUMA node that has any this process may run on, as the kernel lists them under /sys. Machines or
+// containers without NUMA information report a single node holding every allowed CPU.
+std::vector<std::vector<int>> numaNodeCpus();
+
+// Restricts the calling thread to cpus, returns false if the kernel refuses
+bool pinCurrentThread(const std::vector<int> &cpus);
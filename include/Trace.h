@@ -0,0 +1,92 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct TraceEvent {
+    const char *name;
+    int64_t startNs;
+    int64_t durationNs;
+    uint64_t bytes;
+    uint64_t features;
+    uint64_t frame;
+    uint32_t thread;
+};
+
+// Receives every completed trace scope, implementations must be thread safe
+class TraceSink {
+public:
+    virtual ~TraceSink() = default;
+    virtual void record(const TraceEvent &event) = 0;
+};
+
+// Sink used by TRACE_SCOPE, nullptr disables recording at runtime
+void setTraceSink(TraceSink *sink);
+TraceSink *traceSink();
+
+// Frame index attached to subsequent events of the calling thread
+void setTraceFrame(uint64_t frame);
+uint64_t traceFrame();
+
+struct StageStatistics {
+    size_t count = 0;
+    double totalMs = 0;
+    double p50Ms = 0;
+    double p90Ms = 0;
+    double p99Ms = 0;
+    double maxMs = 0;
+    uint64_t bytes = 0;
+    uint64_t features = 0;
+};
+
+// Buffers events in memory and exports them once the run is over
+class TraceRecorder : public TraceSink {
+public:
+    void record(const TraceEvent &event) override;
+    void clear();
+
+    std::vector<TraceEvent> events() const;
+    std::map<std::string, StageStatistics> stageStatistics() const;
+
+    // Chrome trace event format, load in chrome://tracing or Perfetto
+    void writeChromeTrace(std::ostream &out) const;
+    // One row per event: frame, stage, thread, start, duration, bytes, features
+    void writeCsv(std::ostream &out) const;
+    void writeStageSummary(std::ostream &out) const;
+
+private:
+    std::vector<TraceEvent> recorded;
+    mutable std::mutex mutex;
+};
+
+class ScopedTrace {
+public:
+    ScopedTrace(const char *name, uint64_t bytes = 0);
+    ~ScopedTrace();
+
+    void setFeatures(uint64_t count) { features = count; }
+    void addBytes(uint64_t count) { bytes += count; }
+
+private:
+    const char *name;
+    uint64_t bytes;
+    uint64_t features = 0;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Instrumentation compiles to nothing unless OPTICAL_FLOW_ENABLE_TRACING is defined, arguments are not evaluated
+#ifdef OPTICAL_FLOW_ENABLE_TRACING
+#define TRACE_SCOPE(scope, name, bytes) ScopedTrace scope(name, bytes)
+#define TRACE_FEATURES(scope, count) scope.setFeatures(count)
+#define TRACE_BYTES(scope, count) scope.addBytes(count)
+#define TRACE_FRAME(frame) setTraceFrame(frame)
+#else
+#define TRACE_SCOPE(scope, name, bytes) do {} while (0)
+#define TRACE_FEATURES(scope, count) do {} while (0)
+#define TRACE_BYTES(scope, count) do {} while (0)
+#define TRACE_FRAME(frame) do {} while (0)
+#endif
@@ -0,0 +1,47 @@
+#include "FrameArena.h"
+
+ImagePyramid &FrameArena::acquirePyramid() {
+    std::lock_guard lock(mutex);
+    if (pyramidsUsed == pyramids.size()) {
+        pyramids.push_back(std::make_unique<ImagePyramid>());
+    }
+    return *pyramids[pyramidsUsed++];
+}
+
+void FrameArena::reset() {
+    std::lock_guard lock(mutex);
+    std::apply([](auto &...pool) {
+        auto resetPool = [](auto &sizeClasses) {
+            for (auto &[size, sizeClass] : sizeClasses) sizeClass.used = 0;
+        };
+        (resetPool(pool), ...);
+    }, pools);
+    pyramidsUsed = 0;
+}
+
+void FrameArena::clear() {
+    std::lock_guard lock(mutex);
+    std::apply([](auto &...pool) { (pool.clear(), ...); }, pools);
+    pyramids.clear();
+    pyramidsUsed = 0;
+}
+
+size_t FrameArena::bytesReserved() const {
+    std::lock_guard lock(mutex);
+    size_t bytes = 0;
+    std::apply([&bytes](const auto &...pool) {
+        auto countPool = [&bytes](const auto &sizeClasses) {
+            for (const auto &[size, sizeClass] : sizeClasses) {
+                for (const auto &buffer : sizeClass.buffers) bytes += buffer->capacity() * sizeof(buffer->front());
+            }
+        };
+        (countPool(pool), ...);
+    }, pools);
+
+    for (const auto &pyramid : pyramids) {
+        for (const auto &level : pyramid->levels) bytes += level.capacity() * sizeof(double);
+        for (const auto &level : pyramid->gradX) bytes += level.capacity() * sizeof(double);
+        for (const auto &level : pyramid->gradY) bytes += level.capacity() * sizeof(double);
+    }
+    return bytes;
+}
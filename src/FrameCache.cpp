@@ -0,0 +1,71 @@
+#include "FrameCache.h"
+#include "Parallel.h"
+#include "Trace.h"
+
+void FrameCache::setFrame(const std::vector<double> &image, int width, int height, int levels) {
+    arena.reset();
+    levelCount = levels;
+    pyramidLevels.levels.resize(levels);
+    pyramidLevels.gradX.resize(levels);
+    pyramidLevels.gradY.resize(levels);
+    pyramidLevels.sizes.resize(levels);
+    // Copied in the bands the kernels work in, so each band of level 0 starts out on the node that derives from it
+    resizeBanded(pyramidLevels.levels[0], image.size());
+    parallelFor(0, height, [&](int y) {
+        std::copy(image.begin() + y * width, image.begin() + (y + 1) * width, pyramidLevels.levels[0].begin() + y * width);
+    });
+    pyramidLevels.sizes[0] = {width, height};
+    levelsReady = 1;
+    gradientsReady.assign(levels, 0);
+    tensorBlockSize = 0;
+}
+
+void FrameCache::ensureLevels() {
+    if (levelsReady == levelCount) return;
+
+    TRACE_SCOPE(trace, "pyramidBuild", 2 * width() * height() * sizeof(double));
+    for (int l = levelsReady; l < levelCount; l++) {
+        const auto [prevLevelWidth, prevLevelHeight] = pyramidLevels.sizes[l - 1];
+        gaussianPyramid(pyramidLevels.levels[l - 1], prevLevelWidth, prevLevelHeight, 1, pyramidLevels.levels[l], arena);
+        pyramidLevels.sizes[l] = {pyramidLevelSize(prevLevelWidth), pyramidLevelSize(prevLevelHeight)};
+    }
+    levelsReady = levelCount;
+}
+
+void FrameCache::ensureGradients(int level) {
+    if (gradientsReady[level]) return;
+
+    TRACE_SCOPE(trace, "pyramidGradients", 3 * pyramidLevels.levels[level].size() * sizeof(double));
+    const auto [levelWidth, levelHeight] = pyramidLevels.sizes[level];
+    spatialGradients(pyramidLevels.levels[level], levelWidth, levelHeight, pyramidLevels.gradX[level], pyramidLevels.gradY[level]);
+    gradientsReady[level] = 1;
+}
+
+const ImagePyramid &FrameCache::pyramid(bool withGradients) {
+    ensureLevels();
+    if (withGradients) {
+        for (int l = 0; l < levelCount; l++) ensureGradients(l);
+    }
+    return pyramidLevels;
+}
+
+const std::vector<double> &FrameCache::gradX(int level) {
+    if (level > 0) ensureLevels();
+    ensureGradients(level);
+    return pyramidLevels.gradX[level];
+}
+
+const std::vector<double> &FrameCache::gradY(int level) {
+    if (level > 0) ensureLevels();
+    ensureGradients(level);
+    return pyramidLevels.gradY[level];
+}
+
+const FrameCache::StructureTensor &FrameCache::structureTensor(int blockSize) {
+    if (tensorBlockSize != blockSize) {
+        ensureGradients(0);
+        calculateStructureTensor(pyramidLevels.gradX[0], pyramidLevels.gradY[0], width(), height(), blockSize, tensor.Ix2, tensor.IxIy, tensor.Iy2, arena);
+        tensorBlockSize = blockSize;
+    }
+    return tensor;
+}
@@ -1,11 +1,19 @@
 #include "ImageProcessing.h"
+#include "FrameArena.h"
+#include "FrameCache.h"
+#include "Parallel.h"
+#include "Simd.h"
+#include "Trace.h"
+#include <array>
+#include <future>
 
-std::vector<double> convolveImageKernel(const std::vector<double> &image, int width, int height, int channels, std::vector<std::vector<double>> kernel) {
-    std::vector<double>output(width * height * channels);
+void convolveImageKernel(const std::vector<double> &image, int width, int height, int channels, const std::vector<std::vector<double>> &kernel, std::vector<double> &output) {
+    output.resize(width * height * channels);
     // Convolve the kernel at each pixel
     for (int c = 0; c < channels; c++) {
         for (int y = 0; y < height; y++) {
             for (int x = 0; x < width; x++) {
+                double sum = 0;
                 // Loop through each point in the kernel
                 for (int j = 0; j < kernel.size(); j++) {
                     int dy = y + (j - kernel.size() / 2);
@@ -16,54 +24,115 @@ std::vector<double> convolveImageKernel(const std::vector<double> &image, int wi
                         int dx = x + (i - kernel[0].size() / 2);
                         dx = std::clamp(dx, 0, width - 1);
     
-                        output[(x + y * width) * channels + c] += image[(dx + dy * width) * channels + c] * kernel[j][i];
+                        sum += image[(dx + dy * width) * channels + c] * kernel[j][i];
                     }
                 }
+                output[(x + y * width) * channels + c] = sum;
             }
         }
     }
+}
+
+std::vector<double> convolveImageKernel(const std::vector<double> &image, int width, int height, int channels, std::vector<std::vector<double>> kernel) {
+    std::vector<double> output;
+    convolveImageKernel(image, width, height, channels, kernel, output);
     return output;
 }
 
-std::vector<double> boxFilter(const std::vector<double> &image, int width, int height, int channels, int boxSize, bool normalize) {
-    std::vector<double> output(width * height * channels);
+void boxFilter(const std::vector<double> &image, int width, int height, int channels, int boxSize, bool normalize, std::vector<double> &output, FrameArena &arena) {
     double weight = normalize ? 1.0 / (boxSize * boxSize) : 1.0;
+    std::vector<double> &horizontal = arena.acquire(width * height * channels);
     
     std::vector<std::vector<double>> hKernel(1, std::vector<double>(boxSize, 1.0 / weight));
-    output = convolveImageKernel(image, width, height, channels, hKernel);
+    convolveImageKernel(image, width, height, channels, hKernel, horizontal);
     std::vector<std::vector<double>> vKernel(boxSize, std::vector<double>(1, 1.0 / weight));
-    return convolveImageKernel(output, width, height, channels, vKernel);
+    convolveImageKernel(horizontal, width, height, channels, vKernel, output);
 }
 
-std::vector<double> gaussianPyramid(const std::vector<double> &image, int width, int height, int channels) {
-    static const std::vector<std::vector<double>> gaussianKernel = {
-        {1.0 / 16.0, 1.0 / 8.0, 1.0 / 16.0},
-        {1.0 / 8.0, 1.0 / 4.0, 1.0 / 8.0},
-        {1.0 / 16.0, 1.0 / 8.0, 1.0 / 16.0}
-    };
+std::vector<double> boxFilter(const std::vector<double> &image, int width, int height, int channels, int boxSize, bool normalize) {
+    FrameArena arena;
+    std::vector<double> output;
+    boxFilter(image, width, height, channels, boxSize, normalize, output, arena);
+    return output;
+}
 
-    auto blurred = convolveImageKernel(image, width, height, channels, gaussianKernel);
+int pyramidLevelSize(int size) {
+    // Odd sizes keep their last sample so every source pixel is covered by the next level
+    return (size + 1) / 2;
+}
 
-    const int nextWidth = width / 2;
-    const int nextHeight = height / 2;
+void gaussianPyramid(const std::vector<double> &image, int width, int height, int channels, std::vector<double> &output, FrameArena &arena) {
+    TRACE_SCOPE(trace, "pyramidLevel", (width * height + pyramidLevelSize(width) * pyramidLevelSize(height)) * channels * sizeof(double));
+    const int nextWidth = pyramidLevelSize(width);
+    const int nextHeight = pyramidLevelSize(height);
+    const int rowLength = width * channels;
+    resizeBanded(output, nextWidth * nextHeight * channels);
 
-    std::vector<double> nextLevel(nextWidth * nextHeight * channels);
-    
-    for (int c = 0; c < channels; c++) {
-        for (int y = 0; y < nextHeight; y++) {
+    // Separable 5-tap binomial kernel [1 4 6 4 1] / 16, evaluated only at the samples that are kept.
+    // Rows are split into one band per pool worker so each thread reuses one vertically filtered row buffer.
+    const int bandCount = std::min(nextHeight, WorkerPool::instance().size());
+    const int bandHeight = (nextHeight + bandCount - 1) / bandCount;
+    parallelFor(0, bandCount, [&](int band) {
+        // Two replicated pixels on either side remove border checks from the horizontal pass
+        std::vector<double> &filtered = arena.acquire((width + 4) * channels);
+        double *row = &filtered[2 * channels];
+
+        for (int y = band * bandHeight; y < std::min(nextHeight, (band + 1) * bandHeight); y++) {
+            // Pixels beyond image edges replicate the nearest valid pixel
+            const double *r0 = &image[std::clamp(2 * y - 2, 0, height - 1) * rowLength];
+            const double *r1 = &image[std::clamp(2 * y - 1, 0, height - 1) * rowLength];
+            const double *r2 = &image[std::clamp(2 * y, 0, height - 1) * rowLength];
+            const double *r3 = &image[std::clamp(2 * y + 1, 0, height - 1) * rowLength];
+            const double *r4 = &image[std::clamp(2 * y + 2, 0, height - 1) * rowLength];
+            for (int i = 0; i < rowLength; i++) {
+                row[i] = r0[i] + 4.0 * r1[i] + 6.0 * r2[i] + 4.0 * r3[i] + r4[i];
+            }
+            for (int c = 0; c < channels; c++) {
+                filtered[c] = filtered[channels + c] = row[c];
+                row[rowLength + c] = row[rowLength + channels + c] = row[rowLength - channels + c];
+            }
+
+            double *out = &output[y * nextWidth * channels];
             for (int x = 0; x < nextWidth; x++) {
-                const int origX = x * 2;
-                const int origY = y * 2;
-    
-                nextLevel[(x + y * nextWidth) * channels + c] = blurred[(origX + origY * width) * channels + c];
+                for (int c = 0; c < channels; c++) {
+                    const double *center = &row[2 * x * channels + c];
+                    out[x * channels + c] = (center[-2 * channels] + 4.0 * center[-channels] + 6.0 * center[0]
+                                           + 4.0 * center[channels] + center[2 * channels]) * (1.0 / 256.0);
+                }
             }
         }
+    });
+}
+
+void downscaleImage(const std::vector<double> &image, int width, int height, int levels, std::vector<double> &output, int &outputWidth, int &outputHeight, FrameArena &arena) {
+    outputWidth = width;
+    outputHeight = height;
+    if (levels <= 0) {
+        output.assign(image.begin(), image.end());
+        return;
     }
 
+    // Intermediate levels go to scratch buffers, the last one is written to output directly
+    const std::vector<double> *source = &image;
+    for (int l = 0; l < levels; l++) {
+        const int nextWidth = pyramidLevelSize(outputWidth);
+        const int nextHeight = pyramidLevelSize(outputHeight);
+        std::vector<double> &target = l == levels - 1 ? output : arena.acquire(nextWidth * nextHeight);
+        gaussianPyramid(*source, outputWidth, outputHeight, 1, target, arena);
+        outputWidth = nextWidth;
+        outputHeight = nextHeight;
+        source = &target;
+    }
+}
+
+std::vector<double> gaussianPyramid(const std::vector<double> &image, int width, int height, int channels) {
+    FrameArena arena;
+    std::vector<double> nextLevel;
+    gaussianPyramid(image, width, height, channels, nextLevel, arena);
     return nextLevel;
 }
 
-std::vector<double> calculateCovarianceMatrix(const std::vector<double> &image, int width, int height, int blockSize) {
+void calculateCovarianceMatrix(const std::vector<double> &image, int width, int height, int blockSize, std::vector<double> &output, FrameArena &arena) {
     static const std::vector<std::vector<double>> kernelX = {
         {-1, 0, 1},
         {-2, 0, 2},
@@ -76,92 +145,260 @@ std::vector<double> calculateCovarianceMatrix(const std::vector<double> &image,
         {-1, -2, -1}
     };
     
+    const int size = width * height;
+
     // Calculate Image gradients in x and y direction
-    std::vector<double> gradientX = convolveImageKernel(image, width, height, 1, kernelX);
-    std::vector<double> gradientY = convolveImageKernel(image, width, height, 1, kernelY);
+    std::vector<double> &gradientX = arena.acquire(size);
+    std::vector<double> &gradientY = arena.acquire(size);
+    {
+        TRACE_SCOPE(trace, "gradient", 3 * size * sizeof(double));
+        convolveImageKernel(image, width, height, 1, kernelX, gradientX);
+        convolveImageKernel(image, width, height, 1, kernelY, gradientY);
+    }
     
+    TRACE_SCOPE(trace, "structureTensor", 11 * size * sizeof(double));
     // Compute Covariance matrix for each pixel
-    std::vector<double> Ix2(width * height);
-    std::vector<double> IxIy(width * height);
-    std::vector<double> Iy2(width * height);
+    std::vector<double> &Ix2 = arena.acquire(size);
+    std::vector<double> &IxIy = arena.acquire(size);
+    std::vector<double> &Iy2 = arena.acquire(size);
     
-    for (int i = 0; i < width * height; i++) {
+    for (int i = 0; i < size; i++) {
         Ix2[i] = gradientX[i] * gradientX[i];
         IxIy[i] = gradientX[i] * gradientY[i];
         Iy2[i] = gradientY[i] * gradientY[i];
     }
     
-    // Multiply covariance matrix with window (box)
-    Ix2 = boxFilter(Ix2, width, height, 1, blockSize);
-    IxIy = boxFilter(IxIy, width, height, 1, blockSize);
-    Iy2 = boxFilter(Iy2, width, height, 1, blockSize);
+    // Multiply covariance matrix with window (box), the gradient buffers are free to hold the results
+    std::vector<double> &boxIx2 = gradientX;
+    std::vector<double> &boxIxIy = gradientY;
+    std::vector<double> &boxIy2 = arena.acquire(size);
+    boxFilter(Ix2, width, height, 1, blockSize, false, boxIx2, arena);
+    boxFilter(IxIy, width, height, 1, blockSize, false, boxIxIy, arena);
+    boxFilter(Iy2, width, height, 1, blockSize, false, boxIy2, arena);
     
-    std::vector<double> output(3 * width * height);
-    for (int i = 0; i < width * height; i++) {
-        output[3 * i] = Ix2[i];
-        output[3 * i + 1] = IxIy[i];
-        output[3 * i + 2] = Iy2[i];
+    output.resize(3 * size);
+    for (int i = 0; i < size; i++) {
+        output[3 * i] = boxIx2[i];
+        output[3 * i + 1] = boxIxIy[i];
+        output[3 * i + 2] = boxIy2[i];
     }
+}
 
+std::vector<double> calculateCovarianceMatrix(const std::vector<double> &image, int width, int height, int blockSize) {
+    FrameArena arena;
+    std::vector<double> output;
+    calculateCovarianceMatrix(image, width, height, blockSize, output, arena);
     return output;
 }
 
-std::vector<double> harrisCornerDetector(const std::vector<double> &image, int width, int height, int blockSize, double sensitivity) {
-    std::vector<double> output(width * height);
-    std::vector<double> cov = calculateCovarianceMatrix(image, width, height, blockSize);
+// Separable unnormalized box sum with the same window placement as boxFilter, offsets [-size / 2, size - 1 - size / 2]
+static void boxSum(const float *input, int width, int height, int boxSize, float *output, float *scratch) {
+    const int before = boxSize / 2;
+    const int after = boxSize - 1 - before;
 
-    for (int i = 0; i < width * height; i++) {
-        const double Ix2 = cov[3 * i];
-        const double IxIy = cov[3 * i + 1];
-        const double Iy2 = cov[3 * i + 2];
+    parallelFor(0, height, [&](int y) {
+        const float *row = &input[y * width];
+        float *out = &scratch[y * width];
+        for (int x = 0; x < width; x++) {
+            float sum = 0;
+            for (int i = -before; i <= after; i++) sum += row[std::clamp(x + i, 0, width - 1)];
+            out[x] = sum;
+        }
+    });
 
-        // Harris Criterion det(M) - k * trace^2(M)
-        const double determinant = Ix2 * Iy2 - IxIy * IxIy;
-        const double trace = Ix2 + Iy2;
-        output[i] = determinant - sensitivity * trace * trace;
+    parallelFor(0, height, [&](int y) {
+        float *out = &output[y * width];
+        std::fill(out, out + width, 0.0f);
+        for (int j = -before; j <= after; j++) {
+            const float *row = &scratch[std::clamp(y + j, 0, height - 1) * width];
+            for (int x = 0; x < width; x++) out[x] += row[x];
+        }
+    });
+}
+
+// Gradient products summed over a blockSize window, shared by the image and precomputed-gradient entry points
+template <typename Gradient>
+static void accumulateStructureTensor(const Gradient *gradX, const Gradient *gradY, int width, int height, int blockSize, std::vector<float> &Ix2, std::vector<float> &IxIy, std::vector<float> &Iy2, FrameArena &arena) {
+    const int size = width * height;
+    TRACE_SCOPE(trace, "structureTensor", size * 11 * sizeof(float));
+    std::vector<float> &productXX = arena.acquire<float>(size);
+    std::vector<float> &productXY = arena.acquire<float>(size);
+    std::vector<float> &productYY = arena.acquire<float>(size);
+    parallelFor(0, height, [&](int y) {
+        for (int i = y * width; i < (y + 1) * width; i++) {
+            const float gx = static_cast<float>(gradX[i]);
+            const float gy = static_cast<float>(gradY[i]);
+            productXX[i] = gx * gx;
+            productXY[i] = gx * gy;
+            productYY[i] = gy * gy;
+        }
+    });
+
+    std::vector<float> &scratch = arena.acquire<float>(size);
+    resizeBanded(Ix2, size);
+    resizeBanded(IxIy, size);
+    resizeBanded(Iy2, size);
+    boxSum(productXX.data(), width, height, blockSize, Ix2.data(), scratch.data());
+    boxSum(productXY.data(), width, height, blockSize, IxIy.data(), scratch.data());
+    boxSum(productYY.data(), width, height, blockSize, Iy2.data(), scratch.data());
+}
+
+void calculateStructureTensor(const std::vector<double> &image, int width, int height, int blockSize, std::vector<float> &Ix2, std::vector<float> &IxIy, std::vector<float> &Iy2, FrameArena &arena) {
+    const int size = width * height;
+    std::vector<float> &gradientX = arena.acquire<float>(size);
+    std::vector<float> &gradientY = arena.acquire<float>(size);
+
+    {
+        TRACE_SCOPE(trace, "gradient", size * (sizeof(double) + 2 * sizeof(float)));
+        parallelFor(0, height, [&](int y) {
+            // Pixels beyond image edges replicate the nearest valid pixel
+            const double *above = &image[std::max(y - 1, 0) * width];
+            const double *row = &image[y * width];
+            const double *below = &image[std::min(y + 1, height - 1) * width];
+            float *outX = &gradientX[y * width];
+            float *outY = &gradientY[y * width];
+
+            for (int x = 0; x < width; x++) {
+                const int left = std::max(x - 1, 0);
+                const int right = std::min(x + 1, width - 1);
+                outX[x] = static_cast<float>((above[right] - above[left]) + 2.0 * (row[right] - row[left]) + (below[right] - below[left]));
+                outY[x] = static_cast<float>((below[left] + 2.0 * below[x] + below[right]) - (above[left] + 2.0 * above[x] + above[right]));
+            }
+        });
     }
 
-    return output;
+    accumulateStructureTensor(gradientX.data(), gradientY.data(), width, height, blockSize, Ix2, IxIy, Iy2, arena);
 }
 
-std::vector<double> shiTomasiCornerDetector(const std::vector<double> &image, int width, int height, int blockSize) {
-    std::vector<double> output(width * height);
-    std::vector<double> cov = calculateCovarianceMatrix(image, width, height, blockSize);
+void calculateStructureTensor(const std::vector<double> &gradX, const std::vector<double> &gradY, int width, int height, int blockSize, std::vector<float> &Ix2, std::vector<float> &IxIy, std::vector<float> &Iy2, FrameArena &arena) {
+    accumulateStructureTensor(gradX.data(), gradY.data(), width, height, blockSize, Ix2, IxIy, Iy2, arena);
+}
 
-    for (int i = 0; i < width * height; i++) {
-        const double Ix2 = cov[3 * i];
-        const double IxIy = cov[3 * i + 1];
-        const double Iy2 = cov[3 * i + 2];
-        
-        const double determinant = Ix2 * Iy2 - IxIy * IxIy;
-        const double trace = Ix2 + Iy2;
+float shiTomasiResponse(const float *Ix2, const float *IxIy, const float *Iy2, int count, float *response) {
+    TRACE_SCOPE(trace, "cornerResponse", count * 4 * sizeof(float));
+    const SimdFloat half = SimdFloat::broadcast(0.5f);
+    const SimdFloat four = SimdFloat::broadcast(4.0f);
+    SimdFloat maximum = SimdFloat::broadcast(std::numeric_limits<float>::lowest());
+
+    // Smaller eigenvalue directly, (trace - sqrt((a - c)^2 + 4b^2)) / 2
+    int i = 0;
+    for (; i + SimdFloat::width <= count; i += SimdFloat::width) {
+        const SimdFloat a = SimdFloat::load(Ix2 + i);
+        const SimdFloat b = SimdFloat::load(IxIy + i);
+        const SimdFloat c = SimdFloat::load(Iy2 + i);
+        const SimdFloat difference = a - c;
+        const SimdFloat eigenvalue = half * (a + c - sqrt(difference * difference + four * b * b));
+        eigenvalue.store(response + i);
+        maximum = max(maximum, eigenvalue);
+    }
+
+    float maxResponse = maximum.reduceMax();
+    for (; i < count; i++) {
+        const float difference = Ix2[i] - Iy2[i];
+        response[i] = 0.5f * (Ix2[i] + Iy2[i] - std::sqrt(difference * difference + 4.0f * IxIy[i] * IxIy[i]));
+        maxResponse = std::max(maxResponse, response[i]);
+    }
+    return maxResponse;
+}
 
-        // Calculate Eigenvalues using algebraic formula
-        const double discriminant = std::sqrtf(trace * trace - (4.0 * determinant));
-        const double eigenV1 = trace / 2.0 + discriminant;
-        const double eigenV2 = trace / 2.0 - discriminant;
+float harrisResponse(const float *Ix2, const float *IxIy, const float *Iy2, int count, float sensitivity, float *response) {
+    TRACE_SCOPE(trace, "cornerResponse", count * 4 * sizeof(float));
+    const SimdFloat k = SimdFloat::broadcast(sensitivity);
+    SimdFloat maximum = SimdFloat::broadcast(std::numeric_limits<float>::lowest());
 
-        output[i] = std::min(eigenV1, eigenV2);
+    // Harris Criterion det(M) - k * trace^2(M)
+    int i = 0;
+    for (; i + SimdFloat::width <= count; i += SimdFloat::width) {
+        const SimdFloat a = SimdFloat::load(Ix2 + i);
+        const SimdFloat b = SimdFloat::load(IxIy + i);
+        const SimdFloat c = SimdFloat::load(Iy2 + i);
+        const SimdFloat trace = a + c;
+        const SimdFloat value = a * c - b * b - k * trace * trace;
+        value.store(response + i);
+        maximum = max(maximum, value);
     }
 
+    float maxResponse = maximum.reduceMax();
+    for (; i < count; i++) {
+        const float trace = Ix2[i] + Iy2[i];
+        response[i] = Ix2[i] * Iy2[i] - IxIy[i] * IxIy[i] - sensitivity * trace * trace;
+        maxResponse = std::max(maxResponse, response[i]);
+    }
+    return maxResponse;
+}
+
+// Shi-Tomasi response map in float, returns the strongest response
+static float shiTomasiResponseMap(const std::vector<double> &image, int width, int height, int blockSize, std::vector<float> &response, FrameArena &arena) {
+    const int size = width * height;
+    std::vector<float> &Ix2 = arena.acquire<float>(size);
+    std::vector<float> &IxIy = arena.acquire<float>(size);
+    std::vector<float> &Iy2 = arena.acquire<float>(size);
+    calculateStructureTensor(image, width, height, blockSize, Ix2, IxIy, Iy2, arena);
+
+    response.resize(size);
+    return shiTomasiResponse(Ix2.data(), IxIy.data(), Iy2.data(), size, response.data());
+}
+
+// Same response map from the structure tensor the frame cache derives from its level 0 gradients
+static float cachedResponseMap(FrameCache &frame, int blockSize, std::vector<float> &response) {
+    const FrameCache::StructureTensor &tensor = frame.structureTensor(blockSize);
+    const int size = frame.width() * frame.height();
+    response.resize(size);
+    return shiTomasiResponse(tensor.Ix2.data(), tensor.IxIy.data(), tensor.Iy2.data(), size, response.data());
+}
+
+void harrisCornerDetector(const std::vector<double> &image, int width, int height, int blockSize, double sensitivity, std::vector<double> &output, FrameArena &arena) {
+    const int size = width * height;
+    std::vector<float> &Ix2 = arena.acquire<float>(size);
+    std::vector<float> &IxIy = arena.acquire<float>(size);
+    std::vector<float> &Iy2 = arena.acquire<float>(size);
+    std::vector<float> &response = arena.acquire<float>(size);
+    calculateStructureTensor(image, width, height, blockSize, Ix2, IxIy, Iy2, arena);
+    harrisResponse(Ix2.data(), IxIy.data(), Iy2.data(), size, static_cast<float>(sensitivity), response.data());
+
+    output.assign(response.begin(), response.end());
+}
+
+std::vector<double> harrisCornerDetector(const std::vector<double> &image, int width, int height, int blockSize, double sensitivity) {
+    FrameArena arena;
+    std::vector<double> output;
+    harrisCornerDetector(image, width, height, blockSize, sensitivity, output, arena);
     return output;
 }
 
-std::vector<double> threshold(const std::vector<double> &image, int width, int height, double threshold) {
-    std::vector<double>output(width * height);
+void shiTomasiCornerDetector(const std::vector<double> &image, int width, int height, int blockSize, std::vector<double> &output, FrameArena &arena) {
+    std::vector<float> &response = arena.acquire<float>(width * height);
+    shiTomasiResponseMap(image, width, height, blockSize, response, arena);
+
+    output.assign(response.begin(), response.end());
+}
+
+std::vector<double> shiTomasiCornerDetector(const std::vector<double> &image, int width, int height, int blockSize) {
+    FrameArena arena;
+    std::vector<double> output;
+    shiTomasiCornerDetector(image, width, height, blockSize, output, arena);
+    return output;
+}
+
+void threshold(const std::vector<double> &image, int width, int height, double threshold, std::vector<double> &output) {
+    TRACE_SCOPE(trace, "threshold", 3 * width * height * sizeof(double));
+    output.resize(width * height);
     const double maxVal = *std::max_element(image.begin(), image.end());
 
     for (int i = 0; i < width * height; i++) {
-        if (image[i] >= threshold * maxVal) {
-            output[i] = image[i];
-        }
+        output[i] = image[i] >= threshold * maxVal ? image[i] : 0.0;
     }
+}
 
+std::vector<double> threshold(const std::vector<double> &image, int width, int height, double threshold) {
+    std::vector<double> output;
+    ::threshold(image, width, height, threshold, output);
     return output;
 }
 
-std::vector<double> nonMaximalSuppression(const std::vector<double> &image, int width, int height, int blockSize) {
-    std::vector<double>output(width * height);
+void nonMaximalSuppression(const std::vector<double> &image, int width, int height, int blockSize, std::vector<double> &output) {
+    TRACE_SCOPE(trace, "nonMaximalSuppression", 2 * width * height * sizeof(double));
+    output.assign(width * height, 0.0);
 
     // Check for every pixel
     for (int y = 0; y < height; y++) {
@@ -186,58 +423,370 @@ std::vector<double> nonMaximalSuppression(const std::vector<double> &image, int
             }
             // Otherwise this is the maximum pixel in the block
             output[x + y * width] = image[x + y * width];
-        exit:
+        exit:;
         }
     }
-    
+}
+
+std::vector<double> nonMaximalSuppression(const std::vector<double> &image, int width, int height, int blockSize) {
+    std::vector<double> output;
+    nonMaximalSuppression(image, width, height, blockSize, output);
     return output;
 }
 
-std::vector<Vector2f> goodFeaturesToTrack(const std::vector<double> &image, int width, int height, double qualityLevel, double minimumDistance) {
-    std::vector<double> response = shiTomasiCornerDetector(image, width, height, 2);
-    std::vector<double> thresholded = threshold(response, width, height, qualityLevel);
-    std::vector<double> nms = nonMaximalSuppression(thresholded, width, height, 3);
+using Corner = std::pair<float, Vector2f>;
 
-    std::vector<std::pair<double, Vector2f>> corners;
-    // Get response and location of all corners
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            if (nms[x + y * width] > 0) corners.push_back({nms[x + y * width], {static_cast<float>(x), static_cast<float>(y)}});
+// Thresholds and applies 3x3 non-maximal suppression in one pass over [left, right) x [top, bottom),
+// neighbors outside the region are still compared against
+static void collectCorners(const std::vector<float> &response, int width, int height, float cutoff, int left, int top, int right, int bottom, std::vector<Corner> &corners) {
+    for (int y = top; y < bottom; y++) {
+        for (int x = left; x < right; x++) {
+            const float pixelValue = response[x + y * width];
+            if (pixelValue <= 0 || pixelValue < cutoff) continue;
+
+            bool isMaximum = true;
+            for (int dy = std::max(0, y - 1); dy <= std::min(height - 1, y + 1) && isMaximum; dy++) {
+                for (int dx = std::max(0, x - 1); dx <= std::min(width - 1, x + 1); dx++) {
+                    if (response[dx + dy * width] > pixelValue) {
+                        isMaximum = false;
+                        break;
+                    }
+                }
+            }
+            if (isMaximum) corners.push_back({pixelValue, {static_cast<float>(x), static_cast<float>(y)}});
         }
     }
+}
 
-    // Sort corners by strongest response
-    std::sort(corners.begin(), corners.end(), std::greater<std::pair<double, Vector2f>>());
+// Strongest first, ties in raster order so the result does not depend on the order candidates were collected in
+static bool strongerCorner(const Corner &a, const Corner &b) {
+    if (a.first != b.first) return a.first > b.first;
+    return a.second.y != b.second.y ? a.second.y < b.second.y : a.second.x < b.second.x;
+}
 
-    // Remove response data from feature list
-    std::vector<Vector2f> features;
-    features.reserve(corners.size());
+// Local maxima of a whole response map above cutoff, in row bands
+static void collectCorners(const std::vector<float> &response, int width, int height, float cutoff, std::vector<Corner> &corners) {
+    TRACE_SCOPE(trace, "nonMaximalSuppression", width * height * sizeof(float));
+    const int bandCount = std::min(height, WorkerPool::instance().size());
+    std::vector<std::vector<Corner>> bandCorners(bandCount);
+    parallelFor(0, bandCount, [&](int band) {
+        collectCorners(response, width, height, cutoff, 0, height * band / bandCount, width, height * (band + 1) / bandCount, bandCorners[band]);
+    });
+
+    corners.clear();
+    for (const auto &band : bandCorners) corners.insert(corners.end(), band.begin(), band.end());
+}
+
+// Output tile of the fused detector. 128 x 64 pixels with halo hold about 400 KiB of float intermediates, which stays
+// resident in L2 while the tile goes from gradients to candidates.
+static constexpr int detectionTileWidth = 128;
+static constexpr int detectionTileHeight = 64;
+
+// Gradient, structure tensor, Shi-Tomasi response and 3x3 non-maximal suppression fused tile by tile, so none of the
+// intermediates ever makes a round trip through DRAM. Every tile computes its own halo, clamped at the image edges like
+// the whole frame stages, so responses and the returned strongest one match calculateStructureTensor followed by
+// shiTomasiResponse exactly. The quality threshold depends on the strongest response of the whole frame, which is only
+// known at the end. Until then each band suppresses against the strongest response it has seen so far, a lower bound
+// of the final threshold, so candidates are a superset of the corners that pass it.
+static float detectCornerCandidates(const std::vector<double> &image, int width, int height, int blockSize, double qualityLevel, std::vector<Corner> &corners, FrameArena &arena) {
+    TRACE_SCOPE(trace, "detectTiles", width * height * sizeof(double));
+    const int before = blockSize / 2;
+    const int after = blockSize - 1 - before;
+    const int tileColumns = (width + detectionTileWidth - 1) / detectionTileWidth;
+    const int tileRows = (height + detectionTileHeight - 1) / detectionTileHeight;
+
+    // Response region: the tile plus the suppression halo. Product region: the response region plus the box window.
+    const int maxResponseWidth = detectionTileWidth + 2;
+    const int maxResponseHeight = detectionTileHeight + 2;
+    const int maxProductWidth = maxResponseWidth + blockSize - 1;
+    const int maxProductHeight = maxResponseHeight + blockSize - 1;
+    const int productSize = maxProductWidth * maxProductHeight;
+    const int responseSize = maxResponseWidth * maxResponseHeight;
+
+    // One set of tile buffers per band of tile rows, reused for every tile of the band
+    const int bandCount = std::min(tileRows, WorkerPool::instance().size());
+    std::vector<std::vector<Corner>> bandCorners(bandCount);
+    std::vector<float> bandMaximum(bandCount, std::numeric_limits<float>::lowest());
+
+    parallelFor(0, bandCount, [&](int band) {
+        std::vector<float> &products = arena.acquire<float>(3 * productSize);
+        std::vector<float> &horizontal = arena.acquire<float>(3 * maxProductHeight * maxResponseWidth);
+        std::vector<float> &tensor = arena.acquire<float>(3 * responseSize);
+        std::vector<float> &response = arena.acquire<float>(responseSize);
+
+        for (int tileY = tileRows * band / bandCount; tileY < tileRows * (band + 1) / bandCount; tileY++) {
+            for (int tileX = 0; tileX < tileColumns; tileX++) {
+                const int left = tileX * detectionTileWidth;
+                const int top = tileY * detectionTileHeight;
+                const int right = std::min(width, left + detectionTileWidth);
+                const int bottom = std::min(height, top + detectionTileHeight);
+
+                const int responseLeft = std::max(0, left - 1);
+                const int responseTop = std::max(0, top - 1);
+                const int responseWidth = std::min(width, right + 1) - responseLeft;
+                const int responseHeight = std::min(height, bottom + 1) - responseTop;
+                const int productLeft = std::max(0, responseLeft - before);
+                const int productTop = std::max(0, responseTop - before);
+                const int productWidth = std::min(width, responseLeft + responseWidth + after) - productLeft;
+                const int productHeight = std::min(height, responseTop + responseHeight + after) - productTop;
 
-    for (auto& p : corners) {
-        features.push_back(p.second);
+                float *productXX = products.data();
+                float *productXY = productXX + productSize;
+                float *productYY = productXY + productSize;
+                for (int py = 0; py < productHeight; py++) {
+                    const int y = productTop + py;
+                    // Pixels beyond image edges replicate the nearest valid pixel
+                    const double *above = &image[std::max(y - 1, 0) * width];
+                    const double *row = &image[y * width];
+                    const double *below = &image[std::min(y + 1, height - 1) * width];
+                    float *outXX = &productXX[py * maxProductWidth - productLeft];
+                    float *outXY = &productXY[py * maxProductWidth - productLeft];
+                    float *outYY = &productYY[py * maxProductWidth - productLeft];
+                    auto product = [&](int x, int leftX, int rightX) {
+                        const float gx = static_cast<float>((above[rightX] - above[leftX]) + 2.0 * (row[rightX] - row[leftX]) + (below[rightX] - below[leftX]));
+                        const float gy = static_cast<float>((below[leftX] + 2.0 * below[x] + below[rightX]) - (above[leftX] + 2.0 * above[x] + above[rightX]));
+                        outXX[x] = gx * gx;
+                        outXY[x] = gx * gy;
+                        outYY[x] = gy * gy;
+                    };
+
+                    // Only the image's first and last column clamp, the loop between them vectorizes
+                    const int interiorLeft = std::max(productLeft, 1);
+                    const int interiorRight = std::min(productLeft + productWidth, width - 1);
+                    for (int x = productLeft; x < interiorLeft; x++) product(x, std::max(x - 1, 0), std::min(x + 1, width - 1));
+                    for (int x = interiorLeft; x < interiorRight; x++) product(x, x - 1, x + 1);
+                    for (int x = std::max(interiorLeft, interiorRight); x < productLeft + productWidth; x++) product(x, std::max(x - 1, 0), std::min(x + 1, width - 1));
+                }
+
+                // Same summation order as boxSum so the sums come out bit for bit identical
+                for (int plane = 0; plane < 3; plane++) {
+                    const float *product = products.data() + plane * productSize;
+                    float *sums = horizontal.data() + plane * maxProductHeight * maxResponseWidth;
+                    for (int py = 0; py < productHeight; py++) {
+                        const float *productRow = &product[py * maxProductWidth - productLeft];
+                        float *sumRow = &sums[py * maxResponseWidth];
+                        std::fill(sumRow, sumRow + responseWidth, 0.0f);
+                        for (int i = -before; i <= after; i++) {
+                            // Columns whose offset sample lies inside the image, the rest clamp to the edge
+                            const int first = std::clamp(-i - responseLeft, 0, responseWidth);
+                            const int last = std::clamp(width - i - responseLeft, first, responseWidth);
+                            const float *shifted = productRow + responseLeft + i;
+                            for (int rx = 0; rx < first; rx++) sumRow[rx] += productRow[std::clamp(responseLeft + rx + i, 0, width - 1)];
+                            for (int rx = first; rx < last; rx++) sumRow[rx] += shifted[rx];
+                            for (int rx = last; rx < responseWidth; rx++) sumRow[rx] += productRow[std::clamp(responseLeft + rx + i, 0, width - 1)];
+                        }
+                    }
+
+                    float *out = tensor.data() + plane * responseSize;
+                    for (int ry = 0; ry < responseHeight; ry++) {
+                        const int y = responseTop + ry;
+                        float *outRow = &out[ry * responseWidth];
+                        std::fill(outRow, outRow + responseWidth, 0.0f);
+                        for (int j = -before; j <= after; j++) {
+                            const float *sumRow = &sums[(std::clamp(y + j, 0, height - 1) - productTop) * maxResponseWidth];
+                            for (int rx = 0; rx < responseWidth; rx++) outRow[rx] += sumRow[rx];
+                        }
+                    }
+                }
+
+                const int count = responseWidth * responseHeight;
+                const float maximum = shiTomasiResponse(tensor.data(), tensor.data() + responseSize, tensor.data() + 2 * responseSize, count, response.data());
+                bandMaximum[band] = std::max(bandMaximum[band], maximum);
+                const float cutoff = static_cast<float>(qualityLevel * bandMaximum[band]);
+
+                const size_t first = bandCorners[band].size();
+                collectCorners(response, responseWidth, responseHeight, cutoff, left - responseLeft, top - responseTop, right - responseLeft, bottom - responseTop, bandCorners[band]);
+                for (size_t i = first; i < bandCorners[band].size(); i++) {
+                    bandCorners[band][i].second.x += responseLeft;
+                    bandCorners[band][i].second.y += responseTop;
+                }
+            }
+        }
+    });
+
+    corners.clear();
+    for (const auto &band : bandCorners) corners.insert(corners.end(), band.begin(), band.end());
+    return bandCount > 0 ? *std::max_element(bandMaximum.begin(), bandMaximum.end()) : 0.0f;
+}
+
+// Strongest corners at or above the cutoff, greedily thinned to the minimum distance. Accepted features are binned in
+// cells of minimumDistance so each candidate is only checked against the 3x3 cells around it. Cells are never smaller
+// than a few pixels, a tiny minimumDistance would otherwise allocate a cell per fraction of a pixel.
+static void selectFeatures(std::vector<Corner> &corners, float cutoff, double minimumDistance, std::vector<Vector2f> &features) {
+    TRACE_SCOPE(trace, "featureSelection", corners.size() * sizeof(corners[0]));
+    std::erase_if(corners, [cutoff](const Corner &corner) { return corner.first < cutoff; });
+    std::sort(corners.begin(), corners.end(), strongerCorner);
+
+    features.clear();
+    if (minimumDistance <= 0) {
+        for (const auto &corner : corners) features.push_back(corner.second);
+        TRACE_FEATURES(trace, features.size());
+        return;
+    }
+
+    float maxX = 0, maxY = 0;
+    for (const auto &corner : corners) {
+        maxX = std::max(maxX, corner.second.x);
+        maxY = std::max(maxY, corner.second.y);
     }
+    const double cellSize = std::max(minimumDistance, 8.0);
+    const int gridColumns = static_cast<int>(maxX / cellSize) + 1;
+    const int gridRows = static_cast<int>(maxY / cellSize) + 1;
+    std::vector<std::vector<Vector2f>> grid(gridColumns * gridRows);
 
     const double sqMinDist = minimumDistance * minimumDistance;
-    // Reject features within minimum distance
-    for (int i = 0; i < features.size(); i++) {
-        for (int j = i + 1; j < features.size(); j++) {
-            const int xDist = features[i].x - features[j].x;
-            const int yDist = features[i].y - features[j].y;
-            const double sqDist = static_cast<double>(xDist * xDist + yDist * yDist);
-
-            if (sqDist < sqMinDist) {
-                features.erase(features.begin() + j);
-                j--;
+    for (const auto &corner : corners) {
+        const Vector2f &feature = corner.second;
+        const int cellX = static_cast<int>(feature.x / cellSize);
+        const int cellY = static_cast<int>(feature.y / cellSize);
+
+        bool rejected = false;
+        for (int cy = std::max(0, cellY - 1); cy <= std::min(gridRows - 1, cellY + 1) && !rejected; cy++) {
+            for (int cx = std::max(0, cellX - 1); cx <= std::min(gridColumns - 1, cellX + 1) && !rejected; cx++) {
+                for (const auto &accepted : grid[cx + cy * gridColumns]) {
+                    const int xDist = feature.x - accepted.x;
+                    const int yDist = feature.y - accepted.y;
+                    if (static_cast<double>(xDist * xDist + yDist * yDist) < sqMinDist) {
+                        rejected = true;
+                        break;
+                    }
+                }
             }
         }
+        if (rejected) continue;
+
+        grid[cellX + cellY * gridColumns].push_back(feature);
+        features.push_back(feature);
     }
+    TRACE_FEATURES(trace, features.size());
+}
 
+void goodFeaturesToTrack(const std::vector<double> &image, int width, int height, double qualityLevel, double minimumDistance, std::vector<Vector2f> &features, FrameArena &arena) {
+    TRACE_SCOPE(detectTrace, "goodFeaturesToTrack", width * height * sizeof(double));
+    std::vector<Corner> corners;
+    const float maxResponse = detectCornerCandidates(image, width, height, 2, qualityLevel, corners, arena);
+    selectFeatures(corners, static_cast<float>(qualityLevel * maxResponse), minimumDistance, features);
+    TRACE_FEATURES(detectTrace, features.size());
+}
+
+void goodFeaturesToTrack(FrameCache &frame, double qualityLevel, double minimumDistance, std::vector<Vector2f> &features, FrameArena &arena) {
+    TRACE_SCOPE(detectTrace, "goodFeaturesToTrack", frame.width() * frame.height() * sizeof(float));
+    std::vector<float> &response = arena.acquire<float>(frame.width() * frame.height());
+    const float maxResponse = cachedResponseMap(frame, 2, response);
+    const float cutoff = static_cast<float>(qualityLevel * maxResponse);
+    std::vector<Corner> corners;
+    collectCorners(response, frame.width(), frame.height(), cutoff, corners);
+    selectFeatures(corners, cutoff, minimumDistance, features);
+    TRACE_FEATURES(detectTrace, features.size());
+}
+
+std::vector<Vector2f> goodFeaturesToTrack(const std::vector<double> &image, int width, int height, double qualityLevel, double minimumDistance) {
+    FrameArena arena;
+    std::vector<Vector2f> features;
+    goodFeaturesToTrack(image, width, height, qualityLevel, minimumDistance, features, arena);
     return features;
 }
 
-std::vector<uint8_t> convertImageTo8bit(const std::vector<double> &image, int width, int height, int channels, double gamma) {
+// Candidates binned into the detection grid, each cell keeps its strongest corners at or above the cutoff
+static void selectFeaturesBucketed(const std::vector<Corner> &corners, float cutoff, int width, int height, double minimumDistance, int gridColumns, int gridRows, int maxFeaturesPerTile, std::vector<Vector2f> &features) {
+    features.clear();
+    if (maxFeaturesPerTile <= 0) return;
+    // A grid without cells degenerates to one cell along that axis
+    gridColumns = std::max(gridColumns, 1);
+    gridRows = std::max(gridRows, 1);
+    const int tileWidth = std::max((width + gridColumns - 1) / gridColumns, 1);
+    const int tileHeight = std::max((height + gridRows - 1) / gridRows, 1);
+    const double sqMinDist = minimumDistance * minimumDistance;
+
+    auto tooClose = [sqMinDist](const Vector2f &a, const std::vector<Vector2f> &accepted) {
+        for (const auto &b : accepted) {
+            const double xDist = a.x - b.x;
+            const double yDist = a.y - b.y;
+            if (xDist * xDist + yDist * yDist < sqMinDist) return true;
+        }
+        return false;
+    };
+
+    TRACE_SCOPE(trace, "featureSelection", corners.size() * sizeof(corners[0]));
+    std::vector<std::vector<Corner>> tileCorners(gridColumns * gridRows);
+    for (const auto &corner : corners) {
+        if (corner.first < cutoff) continue;
+        const int tileX = static_cast<int>(corner.second.x) / tileWidth;
+        const int tileY = static_cast<int>(corner.second.y) / tileHeight;
+        tileCorners[tileX + tileY * gridColumns].push_back(corner);
+    }
+
+    std::vector<std::vector<Vector2f>> tileFeatures(gridColumns * gridRows);
+    parallelFor(0, gridColumns * gridRows, [&](int tile) {
+        auto &candidates = tileCorners[tile];
+        std::sort(candidates.begin(), candidates.end(), strongerCorner);
+
+        auto &features = tileFeatures[tile];
+        for (const auto &corner : candidates) {
+            if (features.size() >= static_cast<size_t>(maxFeaturesPerTile)) break;
+            if (!tooClose(corner.second, features)) features.push_back(corner.second);
+        }
+    });
+
+    // Enforce the minimum distance across tile borders against tiles that were already merged
+    const int reachX = static_cast<int>(std::ceil(minimumDistance / tileWidth));
+    const int reachY = static_cast<int>(std::ceil(minimumDistance / tileHeight));
+    std::vector<std::vector<Vector2f>> merged(gridColumns * gridRows);
+
+    for (int tile = 0; tile < gridColumns * gridRows; tile++) {
+        const int tileX = tile % gridColumns;
+        const int tileY = tile / gridColumns;
+
+        for (const auto &feature : tileFeatures[tile]) {
+            bool rejected = false;
+            for (int ty = std::max(0, tileY - reachY); ty <= tileY && !rejected; ty++) {
+                for (int tx = std::max(0, tileX - reachX); tx <= std::min(gridColumns - 1, tileX + reachX); tx++) {
+                    const int neighbor = tx + ty * gridColumns;
+                    if (neighbor >= tile) break;
+                    if (tooClose(feature, merged[neighbor])) {
+                        rejected = true;
+                        break;
+                    }
+                }
+            }
+            if (rejected) continue;
+
+            merged[tile].push_back(feature);
+            features.push_back(feature);
+        }
+    }
+    TRACE_FEATURES(trace, features.size());
+}
+
+void goodFeaturesToTrackBucketed(const std::vector<double> &image, int width, int height, double qualityLevel, double minimumDistance, int gridColumns, int gridRows, int maxFeaturesPerTile, std::vector<Vector2f> &features, FrameArena &arena) {
+    TRACE_SCOPE(detectTrace, "goodFeaturesToTrackBucketed", width * height * sizeof(double));
+    std::vector<Corner> corners;
+    const float maxResponse = detectCornerCandidates(image, width, height, 2, qualityLevel, corners, arena);
+    selectFeaturesBucketed(corners, static_cast<float>(qualityLevel * maxResponse), width, height, minimumDistance, gridColumns, gridRows, maxFeaturesPerTile, features);
+    TRACE_FEATURES(detectTrace, features.size());
+}
+
+void goodFeaturesToTrackBucketed(FrameCache &frame, double qualityLevel, double minimumDistance, int gridColumns, int gridRows, int maxFeaturesPerTile, std::vector<Vector2f> &features, FrameArena &arena) {
+    TRACE_SCOPE(detectTrace, "goodFeaturesToTrackBucketed", frame.width() * frame.height() * sizeof(float));
+    std::vector<float> &response = arena.acquire<float>(frame.width() * frame.height());
+    const float maxResponse = cachedResponseMap(frame, 2, response);
+    const float cutoff = static_cast<float>(qualityLevel * maxResponse);
+    std::vector<Corner> corners;
+    collectCorners(response, frame.width(), frame.height(), cutoff, corners);
+    selectFeaturesBucketed(corners, cutoff, frame.width(), frame.height(), minimumDistance, gridColumns, gridRows, maxFeaturesPerTile, features);
+    TRACE_FEATURES(detectTrace, features.size());
+}
+
+std::vector<Vector2f> goodFeaturesToTrackBucketed(const std::vector<double> &image, int width, int height, double qualityLevel, double minimumDistance, int gridColumns, int gridRows, int maxFeaturesPerTile) {
+    FrameArena arena;
+    std::vector<Vector2f> features;
+    goodFeaturesToTrackBucketed(image, width, height, qualityLevel, minimumDistance, gridColumns, gridRows, maxFeaturesPerTile, features, arena);
+    return features;
+}
+
+void convertImageTo8bit(const std::vector<double> &image, int width, int height, int channels, std::vector<uint8_t> &output, double gamma) {
     const int size = width * height * channels;
-    std::vector<uint8_t> output(size);
+    output.resize(size);
     
     // Build Gamma LUT if first time or gamma changes
     static uint8_t gammaLUT[256];
@@ -268,208 +817,801 @@ std::vector<uint8_t> convertImageTo8bit(const std::vector<double> &image, int wi
         // Convert to an 8-bit value using gamma LUT
         output[i] = gammaLUT[static_cast<int>(normalized * 255.0 + 0.5)];
     }
+}
 
+std::vector<uint8_t> convertImageTo8bit(const std::vector<double> &image, int width, int height, int channels, double gamma) {
+    std::vector<uint8_t> output;
+    convertImageTo8bit(image, width, height, channels, output, gamma);
     return output;
-}   
+}
 
-std::vector<Vector2f> lucasKanadeOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, const std::vector<Vector2f> &features, int windowSize) {
-    // Divide by 8 to normalize the kernels and get u & v in terms of pixel per frame
-    static const std::vector<std::vector<double>> sobelX = {
-        {-1.0/8.0, 0, 1.0/8.0},
-        {-2.0/8.0, 0, 2.0/8.0},
-        {-1.0/8.0, 0, 1.0/8.0}
-    };
-    
-    static const std::vector<std::vector<double>> sobelY = {
-        {-1.0/8.0, -2.0/8.0, -1.0/8.0},
-        {0, 0, 0},
-        {1.0/8.0, 2.0/8.0, 1.0/8.0}
+// Sobel gradients normalized by 8 so u & v come out in pixels per frame, borders are reflected
+void spatialGradients(const std::vector<double> &image, int width, int height, std::vector<double> &gradX, std::vector<double> &gradY) {
+    resizeBanded(gradX, width * height);
+    resizeBanded(gradY, width * height);
+
+    auto reflect = [](int i, int size) {
+        if (i < 0) return std::min(-i, size - 1);
+        if (i >= size) return std::max(2 * size - 2 - i, 0);
+        return i;
     };
-    
-    const int kernelSize = sobelX.size();
-    const int halfWindow = windowSize / 2;
-    
-    std::vector<Vector2f> output(features.size());
-    
-    for (int f = 0; f < features.size(); f++) {
-        const int featureX = static_cast<int>(features[f].x + 0.5f);
-        const int featureY = static_cast<int>(features[f].y + 0.5f);
-        
-        // Clamp window borders
-        const int windowLeft = std::max(0, featureX - halfWindow);
-        const int windowRight = std::min(featureX + halfWindow, width - 1);
-        const int windowTop = std::max(0, featureY - halfWindow);
-        const int windowBottom = std::min(featureY + halfWindow, height - 1);
-
-        // Calculate gradients for each pixel inside the window
-        double Ix2 = 0, IxIy = 0, Iy2 = 0, IxIt = 0, IyIt = 0;
-        
-        for (int y = windowTop; y <= windowBottom; y++) {
-            for (int x = windowLeft; x <= windowRight; x++) {
-                const int pixelIndex = x + y * width;
-                const double It = next[pixelIndex] - prev[pixelIndex];
-                
-                // Calculate spatial gradient at pixel
-                double Ix = 0;
-                double Iy = 0;
-                for (int j = 0; j < kernelSize; j++) {
-                    int spatialY = y + (j - kernelSize / 2);
-                    if (spatialY < 0) spatialY = -spatialY;
-                    else if (spatialY >= height) spatialY = 2 * height - 2 - spatialY;
-                    for (int i = 0; i < kernelSize; i++) {
-                        int spatialX = x + (i - kernelSize / 2);
-                        if (spatialX < 0) spatialX = -spatialX;
-                        else if (spatialX >= width) spatialX = 2 * width - 2 - spatialX;
-                        
-                        Ix += prev[spatialX + spatialY * width] * sobelX[j][i];
-                        Iy += prev[spatialX + spatialY * width] * sobelY[j][i];
-                    }
-                }
 
-                Ix2 += Ix * Ix;
-                IxIy += Ix * Iy;
-                Iy2 += Iy * Iy;
-                IxIt += Ix * (-It);
-                IyIt += Iy * (-It);
+    parallelFor(0, height, [&](int y) {
+        const double *above = &image[reflect(y - 1, height) * width];
+        const double *row = &image[y * width];
+        const double *below = &image[reflect(y + 1, height) * width];
+
+        for (int x = 0; x < width; x++) {
+            const int left = reflect(x - 1, width);
+            const int right = reflect(x + 1, width);
+
+            gradX[x + y * width] = ((above[right] - above[left]) + 2.0 * (row[right] - row[left]) + (below[right] - below[left])) / 8.0;
+            gradY[x + y * width] = ((below[left] - above[left]) + 2.0 * (below[x] - above[x]) + (below[right] - above[right])) / 8.0;
+        }
+    });
+}
+
+// Samples a single channel image between pixels, coordinates beyond the edges replicate the nearest valid pixel
+static double sampleBilinear(const std::vector<double> &image, int width, int height, double x, double y) {
+    x = std::clamp(x, 0.0, width - 1.0);
+    y = std::clamp(y, 0.0, height - 1.0);
+
+    const int x0 = static_cast<int>(x);
+    const int y0 = static_cast<int>(y);
+    const int x1 = std::min(x0 + 1, width - 1);
+    const int y1 = std::min(y0 + 1, height - 1);
+    const double ax = x - x0;
+    const double ay = y - y0;
+
+    const double top = image[x0 + y0 * width] * (1.0 - ax) + image[x1 + y0 * width] * ax;
+    const double bottom = image[x0 + y1 * width] * (1.0 - ax) + image[x1 + y1 * width] * ax;
+    return top * (1.0 - ay) + bottom * ay;
+}
+
+// Samples the (2 * halfWindow + 1)^2 window centered on (x, y) row by row into out, rows stride samples apart and
+// consecutive samples Step floats apart. Inside the image every sample shares the bilinear weights of the center, so
+// the rows reduce to fixed weighted sums over contiguous pixels. Windows touching the border clamp sample by sample.
+// Padding at the end of each row is untouched.
+template <int HalfWindow, int Step = 1>
+static void sampleWindow(const std::vector<double> &image, int width, int height, double x, double y, int halfWindow, float *out, int stride) {
+    if constexpr (HalfWindow > 0) halfWindow = HalfWindow;
+    const int side = 2 * halfWindow + 1;
+    const int x0 = static_cast<int>(std::floor(x));
+    const int y0 = static_cast<int>(std::floor(y));
+
+    if (x0 - halfWindow >= 0 && y0 - halfWindow >= 0 && x0 + halfWindow + 1 <= width - 1 && y0 + halfWindow + 1 <= height - 1) {
+        const double ax = x - x0;
+        const double ay = y - y0;
+        for (int j = 0; j < side; j++) {
+            const double *top = &image[(y0 - halfWindow + j) * width + x0 - halfWindow];
+            const double *bottom = top + width;
+            float *row = out + j * stride * Step;
+            for (int i = 0; i < side; i++) {
+                row[i * Step] = static_cast<float>((top[i] * (1.0 - ax) + top[i + 1] * ax) * (1.0 - ay) + (bottom[i] * (1.0 - ax) + bottom[i + 1] * ax) * ay);
             }
         }
+        return;
+    }
+
+    for (int j = -halfWindow; j <= halfWindow; j++) {
+        float *row = out + (j + halfWindow) * stride * Step;
+        for (int i = -halfWindow; i <= halfWindow; i++) row[(i + halfWindow) * Step] = static_cast<float>(sampleBilinear(image, width, height, x + i, y + j));
+    }
+}
+
+// Sums of a * b, a * c and b * c over count floats, count a multiple of SimdFloat::width
+static void dotProducts(const float *a, const float *b, int count, float &aa, float &ab, float &bb) {
+    SimdFloat sumAA = SimdFloat::broadcast(0.0f), sumAB = sumAA, sumBB = sumAA;
+    for (int k = 0; k < count; k += SimdFloat::width) {
+        const SimdFloat x = SimdFloat::load(a + k);
+        const SimdFloat y = SimdFloat::load(b + k);
+        sumAA = sumAA + x * x;
+        sumAB = sumAB + x * y;
+        sumBB = sumBB + y * y;
+    }
+    aa = sumAA.reduceSum();
+    ab = sumAB.reduceSum();
+    bb = sumBB.reduceSum();
+}
+
+// Image mismatch projected onto both gradients, the right hand side of the 2x2 Lucas-Kanade system
+static void mismatchProducts(const float *patch, const float *warped, const float *patchX, const float *patchY, int count, float &IxIt, float &IyIt) {
+    SimdFloat sumX = SimdFloat::broadcast(0.0f), sumY = sumX;
+    for (int k = 0; k < count; k += SimdFloat::width) {
+        const SimdFloat negativeIt = SimdFloat::load(patch + k) - SimdFloat::load(warped + k);
+        sumX = sumX + SimdFloat::load(patchX + k) * negativeIt;
+        sumY = sumY + SimdFloat::load(patchY + k) * negativeIt;
+    }
+    IxIt = sumX.reduceSum();
+    IyIt = sumY.reduceSum();
+}
+
+static float absoluteDifference(const float *a, const float *b, int count) {
+    SimdFloat sum = SimdFloat::broadcast(0.0f);
+    for (int k = 0; k < count; k += SimdFloat::width) sum = sum + abs(SimdFloat::load(a + k) - SimdFloat::load(b + k));
+    return sum.reduceSum();
+}
+
+// Iteratively refines the displacement of each feature between two images of the same pyramid level.
+// flow holds the initial guess on entry and the refined displacement on exit, features that already failed are skipped.
+// Only the finest level decides whether a feature is lost. A coarser level that cannot refine it, because its window
+// is blurred flat or falls outside the level, keeps the guess for the levels below.
+// HalfWindow fixes the window at compile time so every window loop has a constant trip count, 0 reads it from
+// windowSize instead. The window and its gradients are extracted once per feature into separate aligned float planes
+// whose rows are padded with zeros to the SIMD width, so every sum runs as whole vectors and padding adds nothing.
+template <int HalfWindow>
+static void trackFeaturesLevel(const std::vector<double> &prev, const std::vector<double> &gradX, const std::vector<double> &gradY, const std::vector<double> &next, int width, int height, const std::vector<Vector2f> &features, std::vector<Vector2f> &flow, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error, bool finest) {
+    const int maxIterations = 20;
+    const double sqEpsilon = 0.01 * 0.01;
+    const int halfWindow = HalfWindow > 0 ? HalfWindow : windowSize / 2;
+    const int side = 2 * halfWindow + 1;
+    const int windowArea = side * side;
+    const int stride = simdPadded(side);
+    const int paddedArea = side * stride;
+
+    SimdVector<float> patch(paddedArea, 0.0f);
+    SimdVector<float> patchX(paddedArea, 0.0f);
+    SimdVector<float> patchY(paddedArea, 0.0f);
+    SimdVector<float> warped(paddedArea, 0.0f);
+
+    for (int f = 0; f < features.size(); f++) {
+        if (!status[f]) continue;
+
+        const double featureX = features[f].x;
+        const double featureY = features[f].y;
+        if (featureX < 0 || featureY < 0 || featureX > width - 1 || featureY > height - 1) {
+            if (finest) status[f] = 0;
+            continue;
+        }
+
+        // The spatial gradient matrix only depends on the previous image, so sample it once
+        sampleWindow<HalfWindow>(prev, width, height, featureX, featureY, halfWindow, patch.data(), stride);
+        sampleWindow<HalfWindow>(gradX, width, height, featureX, featureY, halfWindow, patchX.data(), stride);
+        sampleWindow<HalfWindow>(gradY, width, height, featureX, featureY, halfWindow, patchY.data(), stride);
+        float sumXX, sumXY, sumYY;
+        dotProducts(patchX.data(), patchY.data(), paddedArea, sumXX, sumXY, sumYY);
+        const double Ix2 = sumXX, IxIy = sumXY, Iy2 = sumYY;
 
-        // Solve the 2x2 system
-        const double determinant = Ix2 * Iy2 - IxIy * IxIy;
-        
         // Check if matrix is invertible
+        const double determinant = Ix2 * Iy2 - IxIy * IxIy;
         if (std::abs(determinant) < 1e-7) {
-            output[f] = features[f];
+            if (finest) status[f] = 0;
             continue;
         }
-        
         const double invDeterminant = 1.0 / determinant;
-        const double u = invDeterminant * (Iy2 * IxIt - IxIy * IyIt);
-        const double v = invDeterminant * (-IxIy * IxIt + Ix2 * IyIt);
-        
-        output[f] = {featureX + static_cast<float>(u), 
-                     featureY + static_cast<float>(v)};
+
+        double u = flow[f].x;
+        double v = flow[f].y;
+        for (int iteration = 0; iteration < maxIterations; iteration++) {
+            sampleWindow<HalfWindow>(next, width, height, featureX + u, featureY + v, halfWindow, warped.data(), stride);
+            float IxIt, IyIt;
+            mismatchProducts(patch.data(), warped.data(), patchX.data(), patchY.data(), paddedArea, IxIt, IyIt);
+
+            // Solve the 2x2 system
+            const double du = invDeterminant * (Iy2 * IxIt - IxIy * IyIt);
+            const double dv = invDeterminant * (-IxIy * IxIt + Ix2 * IyIt);
+            u += du;
+            v += dv;
+
+            if (du * du + dv * dv < sqEpsilon) break;
+        }
+
+        const double trackedX = featureX + u;
+        const double trackedY = featureY + v;
+        if (trackedX < 0 || trackedY < 0 || trackedX > width - 1 || trackedY > height - 1) {
+            if (finest) status[f] = 0;
+            continue;
+        }
+
+        // Tracking error is the mean absolute intensity difference over the window
+        sampleWindow<HalfWindow>(next, width, height, trackedX, trackedY, halfWindow, warped.data(), stride);
+        flow[f] = {static_cast<float>(u), static_cast<float>(v)};
+        error[f] = absoluteDifference(patch.data(), warped.data(), paddedArea) / windowArea;
     }
+}
 
-    return output;
+// Samples the window around (x[l], y[l]) into out for each of the first count lanes with sample[l] set, sample k of
+// lane l at k * width + l. Interior lanes gather the (side + 1)^2 pixels under their window into pixels, after which
+// both bilinear passes run across lanes with per lane weights, so each sample costs one scalar load instead of four.
+// Windows touching the border go through sampleWindow. Lanes that are not sampled end up holding garbage.
+template <int HalfWindow>
+static void gatherWindows(const std::vector<double> &image, int width, int height, const double *x, const double *y, const bool *sample, int count, float *pixels, float *out) {
+    constexpr int lanes = SimdFloat::width;
+    constexpr int side = 2 * HalfWindow + 1;
+    constexpr int span = side + 1;
+    alignas(64) float weightX[lanes] = {}, weightY[lanes] = {};
+    bool border[lanes] = {};
+
+    for (int l = 0; l < count; l++) {
+        if (!sample[l]) continue;
+        const int x0 = static_cast<int>(std::floor(x[l]));
+        const int y0 = static_cast<int>(std::floor(y[l]));
+        if (x0 - HalfWindow < 0 || y0 - HalfWindow < 0 || x0 + HalfWindow + 1 > width - 1 || y0 + HalfWindow + 1 > height - 1) {
+            border[l] = true;
+            continue;
+        }
+        weightX[l] = static_cast<float>(x[l] - x0);
+        weightY[l] = static_cast<float>(y[l] - y0);
+        for (int j = 0; j < span; j++) {
+            const double *row = &image[(y0 - HalfWindow + j) * width + x0 - HalfWindow];
+            for (int i = 0; i < span; i++) pixels[(j * span + i) * lanes + l] = static_cast<float>(row[i]);
+        }
+    }
+
+    // Horizontal pass in place, then the vertical pass into out
+    const SimdFloat ax = SimdFloat::load(weightX);
+    const SimdFloat ay = SimdFloat::load(weightY);
+    const SimdFloat one = SimdFloat::broadcast(1.0f);
+    for (int j = 0; j < span; j++) {
+        float *row = pixels + j * span * lanes;
+        for (int i = 0; i < side; i++) {
+            const SimdFloat left = SimdFloat::load(row + i * lanes);
+            const SimdFloat right = SimdFloat::load(row + (i + 1) * lanes);
+            (left * (one - ax) + right * ax).store(row + i * lanes);
+        }
+    }
+    for (int j = 0; j < side; j++) {
+        const float *top = pixels + j * span * lanes;
+        const float *bottom = top + span * lanes;
+        float *row = out + j * side * lanes;
+        for (int i = 0; i < side; i++) {
+            (SimdFloat::load(top + i * lanes) * (one - ay) + SimdFloat::load(bottom + i * lanes) * ay).store(row + i * lanes);
+        }
+    }
+
+    for (int l = 0; l < count; l++) {
+        if (border[l]) sampleWindow<HalfWindow, lanes>(image, width, height, x[l], y[l], HalfWindow, out + l, side);
+    }
 }
 
-std::vector<Vector2f> lucasKanadeOpticalFlowPyramid(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize) {
-    std::vector<std::vector<double>> prevPyramid(levels);
-    std::vector<std::vector<double>> nextPyramid(levels);
-    std::vector<std::pair<int, int>> pyramidSizes(levels);
-    prevPyramid[0] = prev;
-    nextPyramid[0] = next;
-    pyramidSizes[0] = {width, height};
+// Same refinement as trackFeaturesLevel with one feature per SIMD lane instead of vectorizing within the window, which
+// keeps every lane busy on windows too small to fill several vectors per row. Windows of SimdFloat::width features are
+// gathered into lane interleaved planes, sample k of lane l at k * width + l, and iterate in lockstep until every lane
+// has converged or failed. Lanes that are done stop sampling and their sums are ignored.
+template <int HalfWindow>
+static void trackFeaturesLanes(const std::vector<double> &prev, const std::vector<double> &gradX, const std::vector<double> &gradY, const std::vector<double> &next, int width, int height, const std::vector<Vector2f> &features, std::vector<Vector2f> &flow, int /*windowSize*/, std::vector<uint8_t> &status, std::vector<float> &error, bool finest) {
+    constexpr int lanes = SimdFloat::width;
+    const int maxIterations = 20;
+    const double sqEpsilon = 0.01 * 0.01;
+    constexpr int side = 2 * HalfWindow + 1;
+    constexpr int windowArea = side * side;
 
-    // Construct pyramid
-    for (int l = 1; l < levels; l++) {
-        const int prevLevelWidth = pyramidSizes[l - 1].first;
-        const int prevLevelHeight = pyramidSizes[l - 1].second;
+    SimdVector<float> patch(windowArea * lanes, 0.0f);
+    SimdVector<float> patchX(windowArea * lanes, 0.0f);
+    SimdVector<float> patchY(windowArea * lanes, 0.0f);
+    SimdVector<float> warped(windowArea * lanes, 0.0f);
+    SimdVector<float> pixels((side + 1) * (side + 1) * lanes, 0.0f);
+    alignas(64) float sumA[lanes], sumB[lanes], sumC[lanes];
+    std::array<int, lanes> feature;
+    std::array<double, lanes> Ix2, IxIy, Iy2, invDeterminant, u, v, x, y;
+    std::array<bool, lanes> tracking, all;
+    all.fill(true);
+
+    int f = 0;
+    while (f < features.size()) {
+        int count = 0;
+        for (; f < features.size() && count < lanes; f++) {
+            if (!status[f]) continue;
+            if (features[f].x < 0 || features[f].y < 0 || features[f].x > width - 1 || features[f].y > height - 1) {
+                if (finest) status[f] = 0;
+                continue;
+            }
+            feature[count++] = f;
+        }
+        if (count == 0) break;
+
+        // The spatial gradient matrices only depend on the previous image, so sample them once
+        for (int l = 0; l < count; l++) {
+            x[l] = features[feature[l]].x;
+            y[l] = features[feature[l]].y;
+        }
+        gatherWindows<HalfWindow>(prev, width, height, x.data(), y.data(), all.data(), count, pixels.data(), patch.data());
+        gatherWindows<HalfWindow>(gradX, width, height, x.data(), y.data(), all.data(), count, pixels.data(), patchX.data());
+        gatherWindows<HalfWindow>(gradY, width, height, x.data(), y.data(), all.data(), count, pixels.data(), patchY.data());
+        {
+            SimdFloat xx = SimdFloat::broadcast(0.0f), xy = xx, yy = xx;
+            for (int k = 0; k < windowArea * lanes; k += lanes) {
+                const SimdFloat Ix = SimdFloat::load(patchX.data() + k);
+                const SimdFloat Iy = SimdFloat::load(patchY.data() + k);
+                xx = xx + Ix * Ix;
+                xy = xy + Ix * Iy;
+                yy = yy + Iy * Iy;
+            }
+            xx.store(sumA);
+            xy.store(sumB);
+            yy.store(sumC);
+        }
+
+        int remaining = 0;
+        for (int l = 0; l < count; l++) {
+            Ix2[l] = sumA[l];
+            IxIy[l] = sumB[l];
+            Iy2[l] = sumC[l];
+            // Check if matrix is invertible
+            const double determinant = Ix2[l] * Iy2[l] - IxIy[l] * IxIy[l];
+            tracking[l] = std::abs(determinant) >= 1e-7;
+            if (!tracking[l]) {
+                if (finest) status[feature[l]] = 0;
+                continue;
+            }
+            invDeterminant[l] = 1.0 / determinant;
+            u[l] = flow[feature[l]].x;
+            v[l] = flow[feature[l]].y;
+            remaining++;
+        }
+        std::array<bool, lanes> solved = tracking;
+        std::array<double, lanes> warpedX, warpedY;
+
+        for (int iteration = 0; iteration < maxIterations && remaining > 0; iteration++) {
+            for (int l = 0; l < count; l++) {
+                warpedX[l] = x[l] + u[l];
+                warpedY[l] = y[l] + v[l];
+            }
+            gatherWindows<HalfWindow>(next, width, height, warpedX.data(), warpedY.data(), tracking.data(), count, pixels.data(), warped.data());
+            SimdFloat xt = SimdFloat::broadcast(0.0f), yt = xt;
+            for (int k = 0; k < windowArea * lanes; k += lanes) {
+                const SimdFloat negativeIt = SimdFloat::load(patch.data() + k) - SimdFloat::load(warped.data() + k);
+                xt = xt + SimdFloat::load(patchX.data() + k) * negativeIt;
+                yt = yt + SimdFloat::load(patchY.data() + k) * negativeIt;
+            }
+            xt.store(sumA);
+            yt.store(sumB);
+
+            // Solve the 2x2 systems
+            for (int l = 0; l < count; l++) {
+                if (!tracking[l]) continue;
+                const double IxIt = sumA[l], IyIt = sumB[l];
+                const double du = invDeterminant[l] * (Iy2[l] * IxIt - IxIy[l] * IyIt);
+                const double dv = invDeterminant[l] * (-IxIy[l] * IxIt + Ix2[l] * IyIt);
+                u[l] += du;
+                v[l] += dv;
+                if (du * du + dv * dv < sqEpsilon) {
+                    tracking[l] = false;
+                    remaining--;
+                }
+            }
+        }
 
-        prevPyramid[l] = gaussianPyramid(prevPyramid[l - 1], prevLevelWidth, prevLevelHeight, 1);
-        nextPyramid[l] = gaussianPyramid(nextPyramid[l - 1], prevLevelWidth, prevLevelHeight, 1);
-        pyramidSizes[l] = {prevLevelWidth / 2, prevLevelHeight / 2};
+        // Tracking error is the mean absolute intensity difference over the window
+        for (int l = 0; l < count; l++) {
+            if (!solved[l]) continue;
+            warpedX[l] = x[l] + u[l];
+            warpedY[l] = y[l] + v[l];
+            if (warpedX[l] < 0 || warpedY[l] < 0 || warpedX[l] > width - 1 || warpedY[l] > height - 1) {
+                if (finest) status[feature[l]] = 0;
+                solved[l] = false;
+            }
+        }
+        gatherWindows<HalfWindow>(next, width, height, warpedX.data(), warpedY.data(), solved.data(), count, pixels.data(), warped.data());
+        SimdFloat residual = SimdFloat::broadcast(0.0f);
+        for (int k = 0; k < windowArea * lanes; k += lanes) residual = residual + abs(SimdFloat::load(patch.data() + k) - SimdFloat::load(warped.data() + k));
+        residual.store(sumA);
+        for (int l = 0; l < count; l++) {
+            if (!solved[l]) continue;
+            flow[feature[l]] = {static_cast<float>(u[l]), static_cast<float>(v[l])};
+            error[feature[l]] = sumA[l] / windowArea;
+        }
     }
+}
+
+using TrackLevelFunction = decltype(&trackFeaturesLevel<0>);
+
+// Window sizes in common use get their own instantiation, windowSize is matched on the odd window it spans. Windows
+// narrower than two vectors per row track one feature per lane.
+static constexpr std::pair<int, TrackLevelFunction> specializedWindows[] = {
+    {7, &trackFeaturesLanes<3>},
+    {9, &trackFeaturesLanes<4>},
+    {15, &trackFeaturesLevel<7>},
+    {21, &trackFeaturesLevel<10>},
+    {25, &trackFeaturesLevel<12>},
+    {31, &trackFeaturesLevel<15>},
+};
 
-    std::vector<Vector2f> warpedFeatures(features.begin(), features.end());
-    // Scale the feature's coordinates at the coarsest level
-    float coarsestScale = 1.0f / std::pow(2.0f, levels - 1);
-    for (auto &feature : warpedFeatures) {
-        feature.x *= coarsestScale;
-        feature.y *= coarsestScale;
+static TrackLevelFunction trackLevelFunction(int windowSize) {
+    const int side = 2 * (windowSize / 2) + 1;
+    for (const auto &[size, function] : specializedWindows) {
+        if (size == side) return function;
     }
+    return &trackFeaturesLevel<0>;
+}
+
+// Tracks features from the first pyramid to the second, coarse to fine through the finest levels the two pyramids
+// share, at most maxLevels of them when it is positive
+static std::vector<Vector2f> trackFeaturesPyramid(const ImagePyramid &prevPyramid, const ImagePyramid &nextPyramid, const std::vector<Vector2f> &features, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error, int maxLevels=0) {
+    // Each window samples the previous image, both gradients and the next image
+    [[maybe_unused]] const uint64_t windowBytes = 4 * windowSize * windowSize * sizeof(double);
+    int levels = std::min(prevPyramid.levels.size(), nextPyramid.levels.size());
+    if (maxLevels > 0) levels = std::min(levels, maxLevels);
+    std::vector<Vector2f> flow(features.size(), {0.0f, 0.0f});
+    std::vector<Vector2f> levelFeatures(features.size());
+    const TrackLevelFunction trackLevel = trackLevelFunction(windowSize);
 
     for (int l = levels - 1; l >= 0; l--) {
-        const int levelWidth = pyramidSizes[l].first;
-        const int levelHeight = pyramidSizes[l].second;
+        TRACE_SCOPE(trace, "lucasKanadeLevel", features.size() * windowBytes);
+        TRACE_FEATURES(trace, features.size());
+        const float scale = 1.0f / static_cast<float>(1 << l);
+        for (int f = 0; f < features.size(); f++) {
+            levelFeatures[f] = {features[f].x * scale, features[f].y * scale};
+        }
 
-        warpedFeatures = lucasKanadeOpticalFlow(prevPyramid[l], nextPyramid[l], levelWidth, levelHeight, warpedFeatures, windowSize);
+        trackLevel(prevPyramid.levels[l], prevPyramid.gradX[l], prevPyramid.gradY[l], nextPyramid.levels[l], prevPyramid.sizes[l].first, prevPyramid.sizes[l].second, levelFeatures, flow, windowSize, status, error, l == 0);
 
-        // Rescale the new warped features for the next level until original is reached
+        // Rescale the displacement guess for the next level until original is reached
         if (l > 0) {
-            for (auto &feature : warpedFeatures) {
-                feature.x *= 2;
-                feature.y *= 2;
+            for (auto &displacement : flow) {
+                displacement.x *= 2;
+                displacement.y *= 2;
             }
         }
     }
 
-    return warpedFeatures;
+    std::vector<Vector2f> output(features.size());
+    for (int f = 0; f < features.size(); f++) {
+        output[f] = {features[f].x + flow[f].x, features[f].y + flow[f].y};
+    }
+    return output;
+}
+
+void forwardBackwardCheck(const std::vector<Vector2f> &features, const std::vector<Vector2f> &backTracked, const std::vector<uint8_t> &backStatus, float threshold, std::vector<uint8_t> &status) {
+    const float sqThreshold = threshold * threshold;
+    for (int f = 0; f < features.size(); f++) {
+        const float xDist = backTracked[f].x - features[f].x;
+        const float yDist = backTracked[f].y - features[f].y;
+        if (!backStatus[f] || xDist * xDist + yDist * yDist > sqThreshold) status[f] = 0;
+    }
 }
 
-Eigen::Matrix<double, 2, 3> estimateAffineTransform(const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts, float reprojectionThreshold) {
-    // RANSAC algorithm
-    // Returns a 2x3 matrix [A|B]
-    // [a00 a01 b0]
-    // [a10 a11 b1]
+void buildImagePyramid(const std::vector<double> &image, int width, int height, int levels, ImagePyramid &pyramid, FrameArena &arena, bool computeGradients) {
+    TRACE_SCOPE(trace, "pyramidBuild", 2 * width * height * sizeof(double));
+    pyramid.levels.resize(levels);
+    pyramid.sizes.resize(levels);
+    pyramid.levels[0].assign(image.begin(), image.end());
+    pyramid.sizes[0] = {width, height};
 
-    std::vector<std::pair<Vector2f, Vector2f>> zipped(prevPts.size());
-    for (int i = 0; i < prevPts.size(); i++) {
-        zipped[i] = {prevPts[i], nextPts[i]};
+    // Construct pyramid
+    for (int l = 1; l < levels; l++) {
+        const int prevLevelWidth = pyramid.sizes[l - 1].first;
+        const int prevLevelHeight = pyramid.sizes[l - 1].second;
+
+        gaussianPyramid(pyramid.levels[l - 1], prevLevelWidth, prevLevelHeight, 1, pyramid.levels[l], arena);
+        pyramid.sizes[l] = {pyramidLevelSize(prevLevelWidth), pyramidLevelSize(prevLevelHeight)};
     }
-    
-    // RANSAC Iteration count
-    const int N = 35;
-    
-    int maxInliers = 0;
-    Eigen::Matrix<float, 3, 3> bestTransform;
-    for (int i = 0; i < N; i++) {
-        // Pick 3 random sample points and calculate the hypothesis affine transformation matrix
-        std::vector<std::pair<Vector2f, Vector2f>> sampled;
-        std::sample(zipped.begin(), zipped.end(), std::back_inserter(sampled), 3, std::mt19937{std::random_device{}()});
-
-        Eigen::Matrix<float, 6, 6> M {
-            {sampled[0].first.x, sampled[0].first.y, 1, 0, 0, 0},
-            {0, 0, 0, sampled[0].first.x, sampled[0].first.y, 1},
-            {sampled[1].first.x, sampled[1].first.y, 1, 0, 0, 0},
-            {0, 0, 0, sampled[1].first.x, sampled[1].first.y, 1},
-            {sampled[2].first.x, sampled[2].first.y, 1, 0, 0, 0},
-            {0, 0, 0, sampled[2].first.x, sampled[2].first.y, 1},
-        };
-
-        Eigen::Vector<float, 6> b {
-            sampled[0].second.x,
-            sampled[0].second.y,
-            sampled[1].second.x,
-            sampled[1].second.y,
-            sampled[2].second.x,
-            sampled[2].second.y,
-        };
-
-        // Solve Mp = b for vector p.
-        Eigen::Vector<float, 6> parameters = M.colPivHouseholderQr().solve(b);
-
-        Eigen::Matrix<float, 3, 3> transformation {
-            {parameters(0), parameters(1), parameters(2)},
-            {parameters(3), parameters(4), parameters(5)},
-            {0, 0, 1},
-        };
-
-        float test = parameters(0);
-
-        int inliers = 0;
-        // Score the hypothesis based on predicted location and actual location
-        for (int i = 0; i < prevPts.size(); i++) {
-            Eigen::Matrix<float, 3, 1> pt = {prevPts[i].x, prevPts[i].y, 1};
-            Eigen::Vector<float, 3> predicted = transformation * pt;
-
-            const float xDist = predicted(0) - nextPts[i].x;
-            const float yDist = predicted(1) - nextPts[i].y;
-            const float sqDist = xDist * xDist + yDist * yDist;
-
-            if (sqDist < reprojectionThreshold * reprojectionThreshold) inliers++;
-        }
-
-        if (inliers > maxInliers) {
-            maxInliers = inliers;
-            bestTransform = transformation;
-        }
-    }
-
-    // TODO use least squares to improve transform
-    return Eigen::Matrix<double, 2, 3> {
-        {bestTransform(0, 0), bestTransform(0, 1), bestTransform(0, 2)},
-        {bestTransform(1, 0), bestTransform(1, 1), bestTransform(1, 2)},
+
+    if (!computeGradients) {
+        pyramid.gradX.clear();
+        pyramid.gradY.clear();
+        return;
+    }
+
+    TRACE_SCOPE(gradientTrace, "pyramidGradients", 0);
+    pyramid.gradX.resize(levels);
+    pyramid.gradY.resize(levels);
+    for (int l = 0; l < levels; l++) {
+        TRACE_BYTES(gradientTrace, 3 * pyramid.levels[l].size() * sizeof(double));
+        spatialGradients(pyramid.levels[l], pyramid.sizes[l].first, pyramid.sizes[l].second, pyramid.gradX[l], pyramid.gradY[l]);
+    }
+}
+
+void buildImagePyramid(const std::vector<double> &image, int width, int height, int levels, ImagePyramid &pyramid, bool computeGradients) {
+    FrameArena arena;
+    buildImagePyramid(image, width, height, levels, pyramid, arena, computeGradients);
+}
+
+ImagePyramid buildImagePyramid(const std::vector<double> &image, int width, int height, int levels, bool computeGradients) {
+    ImagePyramid pyramid;
+    buildImagePyramid(image, width, height, levels, pyramid, computeGradients);
+    return pyramid;
+}
+
+static void trackPyramidPair(const ImagePyramid &prev, const ImagePyramid &next, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold, int maxLevels) {
+    // status holds one entry per feature on entry, features already marked lost are skipped
+    error.assign(features.size(), 0.0f);
+
+    // Tracking reads the gradients of prev, and those of next to track backwards. Pyramids built without them lose
+    // every feature instead of being read out of bounds.
+    if (prev.gradX.size() < prev.levels.size() || (forwardBackwardThreshold > 0 && next.gradX.size() < next.levels.size())) {
+        tracked = features;
+        status.assign(features.size(), 0);
+        return;
+    }
+
+    tracked = trackFeaturesPyramid(prev, next, features, windowSize, status, error, maxLevels);
+
+    if (forwardBackwardThreshold > 0) {
+        std::vector<uint8_t> backStatus(status);
+        std::vector<float> backError(features.size());
+        auto backTracked = trackFeaturesPyramid(next, prev, tracked, windowSize, backStatus, backError, maxLevels);
+        forwardBackwardCheck(features, backTracked, backStatus, forwardBackwardThreshold, status);
+    }
+}
+
+void lucasKanadeOpticalFlowPyramid(const ImagePyramid &prev, const ImagePyramid &next, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold) {
+    status.assign(features.size(), 1);
+    trackPyramidPair(prev, next, features, windowSize, tracked, status, error, forwardBackwardThreshold, 0);
+}
+
+std::vector<Vector2f> lucasKanadeOpticalFlowPyramid(const ImagePyramid &prev, const ImagePyramid &next, const std::vector<Vector2f> &features, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold) {
+    std::vector<Vector2f> tracked;
+    lucasKanadeOpticalFlowPyramid(prev, next, features, windowSize, tracked, status, error, forwardBackwardThreshold);
+    return tracked;
+}
+
+void lucasKanadeOpticalFlowPyramid(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, FrameArena &arena, float forwardBackwardThreshold) {
+    ImagePyramid &prevPyramid = arena.acquirePyramid();
+    ImagePyramid &nextPyramid = arena.acquirePyramid();
+    // Gradients of the next frame are only needed to track backwards
+    buildImagePyramid(prev, width, height, levels, prevPyramid, arena);
+    buildImagePyramid(next, width, height, levels, nextPyramid, arena, forwardBackwardThreshold > 0);
+
+    lucasKanadeOpticalFlowPyramid(prevPyramid, nextPyramid, features, windowSize, tracked, status, error, forwardBackwardThreshold);
+}
+
+void lucasKanadeOpticalFlowPyramid(FrameCache &prev, FrameCache &next, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold, int levels) {
+    // Gradients of the next frame are only needed to track backwards
+    const ImagePyramid &prevPyramid = prev.pyramid();
+    const ImagePyramid &nextPyramid = next.pyramid(forwardBackwardThreshold > 0);
+
+    status.assign(features.size(), 1);
+    trackPyramidPair(prevPyramid, nextPyramid, features, windowSize, tracked, status, error, forwardBackwardThreshold, levels);
+}
+
+std::vector<Vector2f> lucasKanadeOpticalFlowPyramid(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold) {
+    FrameArena arena;
+    std::vector<Vector2f> tracked;
+    lucasKanadeOpticalFlowPyramid(prev, next, width, height, levels, features, windowSize, tracked, status, error, arena, forwardBackwardThreshold);
+    return tracked;
+}
+
+std::vector<Vector2f> lucasKanadeOpticalFlowPyramid(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize) {
+    std::vector<uint8_t> status;
+    std::vector<float> error;
+    auto tracked = lucasKanadeOpticalFlowPyramid(prev, next, width, height, levels, features, windowSize, status, error);
+
+    // Features that could not be tracked keep their original position
+    for (int f = 0; f < features.size(); f++) {
+        if (!status[f]) tracked[f] = features[f];
+    }
+    return tracked;
+}
+
+void lucasKanadeOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, FrameArena &arena, float forwardBackwardThreshold) {
+    lucasKanadeOpticalFlowPyramid(prev, next, width, height, 1, features, windowSize, tracked, status, error, arena, forwardBackwardThreshold);
+}
+
+std::vector<Vector2f> lucasKanadeOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, const std::vector<Vector2f> &features, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold) {
+    return lucasKanadeOpticalFlowPyramid(prev, next, width, height, 1, features, windowSize, status, error, forwardBackwardThreshold);
+}
+
+std::vector<Vector2f> lucasKanadeOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, const std::vector<Vector2f> &features, int windowSize) {
+    return lucasKanadeOpticalFlowPyramid(prev, next, width, height, 1, features, windowSize);
+}
+
+std::vector<std::vector<Vector2f>> lucasKanadeOpticalFlowBatch(const std::vector<std::vector<double>> &frames, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize, std::vector<std::vector<uint8_t>> &status, float forwardBackwardThreshold) {
+    const int frameCount = frames.size();
+    std::vector<std::vector<Vector2f>> tracks(frameCount);
+    status.assign(frameCount, std::vector<uint8_t>(features.size(), 1));
+    if (frameCount == 0) return tracks;
+    tracks[0] = features;
+
+    // Three resident pyramids: the pair being tracked and the one being built in the background
+    std::array<ImagePyramid, 3> pyramids;
+    std::array<FrameArena, 3> arenas;
+    auto build = [&](int k) {
+        arenas[k % 3].reset();
+        buildImagePyramid(frames[k], width, height, levels, pyramids[k % 3], arenas[k % 3]);
     };
-}
\ No newline at end of file
+    build(0);
+
+    std::future<void> pending;
+    if (frameCount > 1) {
+        pending = std::async(std::launch::async, build, 1);
+    }
+
+    std::vector<float> error;
+    for (int k = 0; k + 1 < frameCount; k++) {
+        pending.get();
+        // Overlap construction of the pyramid after next with tracking of the current pair
+        if (k + 2 < frameCount) {
+            pending = std::async(std::launch::async, build, k + 2);
+        }
+
+        // Lost features stay lost for the rest of the batch
+        status[k + 1] = status[k];
+        trackPyramidPair(pyramids[k % 3], pyramids[(k + 1) % 3], tracks[k], windowSize, tracks[k + 1], status[k + 1], error, forwardBackwardThreshold, 0);
+
+        for (int f = 0; f < features.size(); f++) {
+            if (!status[k + 1][f]) tracks[k + 1][f] = tracks[k][f];
+        }
+    }
+
+    return tracks;
+}
+
+// Grid points of the dense flow: every gridStep-th pixel plus the last one, so interpolation reaches every pixel
+static int flowGridCount(int size, int gridStep) {
+    return (size - 1 + gridStep - 1) / gridStep + 1;
+}
+
+static int flowGridPosition(int index, int size, int gridStep) {
+    return std::min(index * gridStep, size - 1);
+}
+
+// Grid points tracked together, 8 x 8 of them cover a 64 x 64 pixel tile at the default step
+static constexpr int denseFlowTileSize = 8;
+
+// Grid points LK could not track take the mean flow of their tracked 4-neighbours, sweep after sweep, until every
+// point reachable from a tracked one is filled. With nothing tracked at all the flow stays zero.
+static void fillFlowHoles(std::vector<Vector2f> &gridFlow, std::vector<uint8_t> &tracked, int columns, int rows) {
+    std::vector<std::pair<int, Vector2f>> filled;
+    while (true) {
+        filled.clear();
+        for (int y = 0; y < rows; y++) {
+            for (int x = 0; x < columns; x++) {
+                const int index = y * columns + x;
+                if (tracked[index]) continue;
+                Vector2f sum = {0.0f, 0.0f};
+                int count = 0;
+                auto add = [&](int neighbour) {
+                    if (!tracked[neighbour]) return;
+                    sum.x += gridFlow[neighbour].x;
+                    sum.y += gridFlow[neighbour].y;
+                    count++;
+                };
+                if (x > 0) add(index - 1);
+                if (x + 1 < columns) add(index + 1);
+                if (y > 0) add(index - columns);
+                if (y + 1 < rows) add(index + columns);
+                if (count > 0) filled.push_back({index, {sum.x / count, sum.y / count}});
+            }
+        }
+        if (filled.empty()) break;
+        for (const auto &[index, flow] : filled) {
+            gridFlow[index] = flow;
+            tracked[index] = 1;
+        }
+    }
+}
+
+static void denseFlowPyramid(const ImagePyramid &prev, const ImagePyramid &next, int gridStep, int windowSize, std::vector<Vector2f> &flow, int maxLevels) {
+    // Empty pyramids or frames of different sizes have no flow field, a prev built without gradients has zero flow
+    if (prev.sizes.empty() || next.sizes.empty() || prev.sizes[0] != next.sizes[0]) {
+        flow.clear();
+        return;
+    }
+    const int width = prev.sizes[0].first;
+    const int height = prev.sizes[0].second;
+    if (prev.gradX.size() < prev.levels.size()) {
+        flow.assign(width * height, {0.0f, 0.0f});
+        return;
+    }
+    gridStep = std::max(gridStep, 1);
+    const int columns = flowGridCount(width, gridStep);
+    const int rows = flowGridCount(height, gridStep);
+    std::vector<Vector2f> gridFlow(columns * rows);
+    std::vector<uint8_t> tracked(columns * rows);
+
+    // Tiles of grid points run as independent sparse tracks, each on the worker owning its band of tiles
+    const int tileColumns = (columns + denseFlowTileSize - 1) / denseFlowTileSize;
+    const int tileRows = (rows + denseFlowTileSize - 1) / denseFlowTileSize;
+    parallelFor(0, tileColumns * tileRows, [&](int tile) {
+        const int left = tile % tileColumns * denseFlowTileSize;
+        const int top = tile / tileColumns * denseFlowTileSize;
+        const int right = std::min(left + denseFlowTileSize, columns);
+        const int bottom = std::min(top + denseFlowTileSize, rows);
+
+        std::vector<Vector2f> points;
+        points.reserve((right - left) * (bottom - top));
+        for (int y = top; y < bottom; y++) {
+            for (int x = left; x < right; x++) {
+                points.push_back({static_cast<float>(flowGridPosition(x, width, gridStep)), static_cast<float>(flowGridPosition(y, height, gridStep))});
+            }
+        }
+        std::vector<uint8_t> status(points.size(), 1);
+        std::vector<float> error(points.size());
+        const std::vector<Vector2f> moved = trackFeaturesPyramid(prev, next, points, windowSize, status, error, maxLevels);
+
+        int p = 0;
+        for (int y = top; y < bottom; y++) {
+            for (int x = left; x < right; x++, p++) {
+                gridFlow[y * columns + x] = {moved[p].x - points[p].x, moved[p].y - points[p].y};
+                tracked[y * columns + x] = status[p];
+            }
+        }
+    });
+
+    fillFlowHoles(gridFlow, tracked, columns, rows);
+
+    // Bilinear interpolation between the four grid points around every pixel
+    TRACE_SCOPE(trace, "denseFlowInterpolation", width * height * sizeof(Vector2f));
+    resizeBanded(flow, width * height);
+    parallelFor(0, height, [&](int y) {
+        const int gridY = std::min(y / gridStep, rows - 1);
+        const int nextY = std::min(gridY + 1, rows - 1);
+        const int spanY = flowGridPosition(nextY, height, gridStep) - flowGridPosition(gridY, height, gridStep);
+        const float ay = spanY > 0 ? static_cast<float>(y - flowGridPosition(gridY, height, gridStep)) / spanY : 0.0f;
+        const Vector2f *top = &gridFlow[gridY * columns];
+        const Vector2f *bottom = &gridFlow[nextY * columns];
+        Vector2f *row = &flow[y * width];
+
+        for (int x = 0; x < width; x++) {
+            const int gridX = std::min(x / gridStep, columns - 1);
+            const int nextX = std::min(gridX + 1, columns - 1);
+            const int spanX = flowGridPosition(nextX, width, gridStep) - flowGridPosition(gridX, width, gridStep);
+            const float ax = spanX > 0 ? static_cast<float>(x - flowGridPosition(gridX, width, gridStep)) / spanX : 0.0f;
+            const float topX = top[gridX].x + (top[nextX].x - top[gridX].x) * ax;
+            const float topY = top[gridX].y + (top[nextX].y - top[gridX].y) * ax;
+            const float bottomX = bottom[gridX].x + (bottom[nextX].x - bottom[gridX].x) * ax;
+            const float bottomY = bottom[gridX].y + (bottom[nextX].y - bottom[gridX].y) * ax;
+            row[x] = {topX + (bottomX - topX) * ay, topY + (bottomY - topY) * ay};
+        }
+    });
+}
+
+void denseOpticalFlow(const ImagePyramid &prev, const ImagePyramid &next, int gridStep, int windowSize, std::vector<Vector2f> &flow) {
+    denseFlowPyramid(prev, next, gridStep, windowSize, flow, 0);
+}
+
+void denseOpticalFlow(FrameCache &prev, FrameCache &next, int gridStep, int windowSize, std::vector<Vector2f> &flow, int levels) {
+    // Only the previous frame needs gradients, tracking runs forward
+    const ImagePyramid &prevPyramid = prev.pyramid();
+    const ImagePyramid &nextPyramid = next.pyramid(false);
+    denseFlowPyramid(prevPyramid, nextPyramid, gridStep, windowSize, flow, levels);
+}
+
+void denseOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, int gridStep, int windowSize, std::vector<Vector2f> &flow, FrameArena &arena) {
+    ImagePyramid &prevPyramid = arena.acquirePyramid();
+    ImagePyramid &nextPyramid = arena.acquirePyramid();
+    buildImagePyramid(prev, width, height, levels, prevPyramid, arena);
+    buildImagePyramid(next, width, height, levels, nextPyramid, arena, false);
+    denseFlowPyramid(prevPyramid, nextPyramid, gridStep, windowSize, flow, 0);
+}
+
+std::vector<Vector2f> denseOpticalFlow(const std::vector<double> &prev, const std::vector<double> &next, int width, int height, int levels, int gridStep, int windowSize) {
+    FrameArena arena;
+    std::vector<Vector2f> flow;
+    denseOpticalFlow(prev, next, width, height, levels, gridStep, windowSize, flow, arena);
+    return flow;
+}
+
+void removeRejectedFeatures(std::vector<Vector2f> &prevPts, std::vector<Vector2f> &nextPts, const std::vector<uint8_t> &status) {
+    int kept = 0;
+    for (int f = 0; f < status.size(); f++) {
+        if (!status[f]) continue;
+        prevPts[kept] = prevPts[f];
+        nextPts[kept] = nextPts[f];
+        kept++;
+    }
+    prevPts.resize(kept);
+    nextPts.resize(kept);
+}
+
+Eigen::Matrix<double, 2, 3> scaleAffineTransform(const Eigen::Matrix<double, 2, 3> &transform, double scale) {
+    // Level samples sit on every 2^L-th full resolution pixel, so p = scale * q and the linear part is unchanged
+    Eigen::Matrix<double, 2, 3> scaled = transform;
+    scaled.col(2) *= scale;
+    return scaled;
+}
+
+void warpAffine(const std::vector<double> &image, int width, int height, const Eigen::Matrix<double, 2, 3> &transform, std::vector<double> &output) {
+    TRACE_SCOPE(trace, "warpAffine", 2 * width * height * sizeof(double));
+    // Every output pixel pulls from where the inverse transform sends it, so no holes open up
+    Eigen::Matrix3d forward = Eigen::Matrix3d::Identity();
+    forward.topRows<2>() = transform;
+    const Eigen::Matrix<double, 2, 3> inverse = forward.inverse().topRows<2>();
+
+    resizeBanded(output, width * height);
+    parallelFor(0, height, [&](int y) {
+        double *out = &output[y * width];
+        for (int x = 0; x < width; x++) {
+            const double sourceX = inverse(0, 0) * x + inverse(0, 1) * y + inverse(0, 2);
+            const double sourceY = inverse(1, 0) * x + inverse(1, 1) * y + inverse(1, 2);
+            out[x] = sampleBilinear(image, width, height, sourceX, sourceY);
+        }
+    });
+}
+
+std::vector<double> warpAffine(const std::vector<double> &image, int width, int height, const Eigen::Matrix<double, 2, 3> &transform) {
+    std::vector<double> output;
+    warpAffine(image, width, height, transform, output);
+    return output;
+}
@@ -0,0 +1,384 @@
+#include "ImageProcessing.h"
+#include "Parallel.h"
+#include "Trace.h"
+
+// Fixed-point variants of the pipeline for 8-bit input. Gradients are unnormalized Sobel responses in int16
+// (|g| <= 4 * 255), structure tensor sums are int32 and floating point is only used for the final eigenvalue
+// and the 2x2 solve. Interior loops are branch free over contiguous rows so the compiler can vectorize them.
+
+// Bilinear weights are quantized to 14 bits, tracked intensities keep 5 fractional bits
+static constexpr int weightBits = 14;
+static constexpr int intensityBits = 5;
+
+void sobelGradients(const std::vector<uint8_t> &image, int width, int height, std::vector<int16_t> &gradX, std::vector<int16_t> &gradY) {
+    TRACE_SCOPE(trace, "gradient", width * height * (sizeof(uint8_t) + 2 * sizeof(int16_t)));
+    resizeBanded(gradX, width * height);
+    resizeBanded(gradY, width * height);
+
+    parallelFor(0, height, [&](int y) {
+        // Pixels beyond image edges replicate the nearest valid pixel
+        const uint8_t *above = &image[std::max(y - 1, 0) * width];
+        const uint8_t *row = &image[y * width];
+        const uint8_t *below = &image[std::min(y + 1, height - 1) * width];
+        int16_t *outX = &gradX[y * width];
+        int16_t *outY = &gradY[y * width];
+
+        auto gradientAt = [&](int x) {
+            const int left = std::max(x - 1, 0);
+            const int right = std::min(x + 1, width - 1);
+            outX[x] = (above[right] - above[left]) + 2 * (row[right] - row[left]) + (below[right] - below[left]);
+            outY[x] = (below[left] + 2 * below[x] + below[right]) - (above[left] + 2 * above[x] + above[right]);
+        };
+
+        gradientAt(0);
+        for (int x = 1; x < width - 1; x++) {
+            outX[x] = (above[x + 1] - above[x - 1]) + 2 * (row[x + 1] - row[x - 1]) + (below[x + 1] - below[x - 1]);
+            outY[x] = (below[x - 1] + 2 * below[x] + below[x + 1]) - (above[x - 1] + 2 * above[x] + above[x + 1]);
+        }
+        if (width > 1) gradientAt(width - 1);
+    });
+}
+
+// Unnormalized box sum with the same window placement as boxFilter, offsets [-size / 2, size - 1 - size / 2]
+static void boxSum(const int32_t *input, int width, int height, int boxSize, int32_t *output) {
+    const int before = boxSize / 2;
+    const int after = boxSize - 1 - before;
+
+    std::vector<int32_t> horizontal(width * height);
+    parallelFor(0, height, [&](int y) {
+        std::vector<int32_t> padded(width + boxSize - 1);
+        const int32_t *row = &input[y * width];
+        for (int x = 0; x < static_cast<int>(padded.size()); x++) {
+            padded[x] = row[std::clamp(x - before, 0, width - 1)];
+        }
+
+        int32_t *out = &horizontal[y * width];
+        std::fill(out, out + width, 0);
+        for (int i = 0; i < boxSize; i++) {
+            for (int x = 0; x < width; x++) out[x] += padded[x + i];
+        }
+    });
+
+    parallelFor(0, height, [&](int y) {
+        int32_t *out = &output[y * width];
+        std::fill(out, out + width, 0);
+        for (int j = -before; j <= after; j++) {
+            const int32_t *row = &horizontal[std::clamp(y + j, 0, height - 1) * width];
+            for (int x = 0; x < width; x++) out[x] += row[x];
+        }
+    });
+}
+
+void calculateCovarianceMatrix(const std::vector<uint8_t> &image, int width, int height, int blockSize, std::vector<int32_t> &output) {
+    const int size = width * height;
+    std::vector<int16_t> gradientX, gradientY;
+    sobelGradients(image, width, height, gradientX, gradientY);
+
+    TRACE_SCOPE(trace, "structureTensor", size * (2 * sizeof(int16_t) + 9 * sizeof(int32_t)));
+    // Products fit in int32 and so do their sums for blocks up to 45x45, larger blocks are clamped to that
+    blockSize = std::min(blockSize, 45);
+    std::vector<int32_t> products(3 * size);
+    int32_t *Ix2 = &products[0];
+    int32_t *IxIy = &products[size];
+    int32_t *Iy2 = &products[2 * size];
+    for (int i = 0; i < size; i++) {
+        Ix2[i] = gradientX[i] * gradientX[i];
+        IxIy[i] = gradientX[i] * gradientY[i];
+        Iy2[i] = gradientY[i] * gradientY[i];
+    }
+
+    std::vector<int32_t> sums(3 * size);
+    for (int plane = 0; plane < 3; plane++) {
+        boxSum(&products[plane * size], width, height, blockSize, &sums[plane * size]);
+    }
+
+    // Same interleaved layout as the double version
+    output.resize(3 * size);
+    for (int i = 0; i < size; i++) {
+        output[3 * i] = sums[i];
+        output[3 * i + 1] = sums[size + i];
+        output[3 * i + 2] = sums[2 * size + i];
+    }
+}
+
+void shiTomasiCornerDetector(const std::vector<uint8_t> &image, int width, int height, int blockSize, std::vector<float> &output) {
+    std::vector<int32_t> cov;
+    calculateCovarianceMatrix(image, width, height, blockSize, cov);
+
+    TRACE_SCOPE(trace, "cornerResponse", width * height * (3 * sizeof(int32_t) + sizeof(float)));
+    output.resize(width * height);
+    for (int i = 0; i < width * height; i++) {
+        const float Ix2 = static_cast<float>(cov[3 * i]);
+        const float IxIy = static_cast<float>(cov[3 * i + 1]);
+        const float Iy2 = static_cast<float>(cov[3 * i + 2]);
+
+        // Smaller eigenvalue of the 2x2 tensor
+        const float difference = Ix2 - Iy2;
+        output[i] = 0.5f * (Ix2 + Iy2 - std::sqrt(difference * difference + 4.0f * IxIy * IxIy));
+    }
+}
+
+void gaussianPyramid(const std::vector<uint8_t> &image, int width, int height, std::vector<uint8_t> &output) {
+    TRACE_SCOPE(trace, "pyramidLevel", (width * height + pyramidLevelSize(width) * pyramidLevelSize(height)) * sizeof(uint8_t));
+    const int nextWidth = pyramidLevelSize(width);
+    const int nextHeight = pyramidLevelSize(height);
+    resizeBanded(output, nextWidth * nextHeight);
+
+    // Same 5-tap binomial kernel and bands as the double version, the vertical pass fits in uint16 (16 * 255)
+    const int bandCount = std::min(nextHeight, WorkerPool::instance().size());
+    const int bandHeight = (nextHeight + bandCount - 1) / bandCount;
+    parallelFor(0, bandCount, [&](int band) {
+        std::vector<uint16_t> filtered(width + 4);
+        uint16_t *row = &filtered[2];
+
+        for (int y = band * bandHeight; y < std::min(nextHeight, (band + 1) * bandHeight); y++) {
+            const uint8_t *r0 = &image[std::clamp(2 * y - 2, 0, height - 1) * width];
+            const uint8_t *r1 = &image[std::clamp(2 * y - 1, 0, height - 1) * width];
+            const uint8_t *r2 = &image[std::clamp(2 * y, 0, height - 1) * width];
+            const uint8_t *r3 = &image[std::clamp(2 * y + 1, 0, height - 1) * width];
+            const uint8_t *r4 = &image[std::clamp(2 * y + 2, 0, height - 1) * width];
+            for (int x = 0; x < width; x++) {
+                row[x] = static_cast<uint16_t>(r0[x] + 4 * r1[x] + 6 * r2[x] + 4 * r3[x] + r4[x]);
+            }
+            filtered[0] = filtered[1] = row[0];
+            row[width] = row[width + 1] = row[width - 1];
+
+            uint8_t *out = &output[y * nextWidth];
+            for (int x = 0; x < nextWidth; x++) {
+                const uint16_t *center = &row[2 * x];
+                const int sum = center[-2] + 4 * center[-1] + 6 * center[0] + 4 * center[1] + center[2];
+                out[x] = static_cast<uint8_t>((sum + 128) >> 8);
+            }
+        }
+    });
+}
+
+void buildImagePyramid(const std::vector<uint8_t> &image, int width, int height, int levels, ImagePyramid8u &pyramid, bool computeGradients) {
+    TRACE_SCOPE(trace, "pyramidBuild", 2 * width * height * sizeof(uint8_t));
+    pyramid.levels.resize(levels);
+    pyramid.sizes.resize(levels);
+    pyramid.levels[0].assign(image.begin(), image.end());
+    pyramid.sizes[0] = {width, height};
+
+    for (int l = 1; l < levels; l++) {
+        const auto [prevLevelWidth, prevLevelHeight] = pyramid.sizes[l - 1];
+        gaussianPyramid(pyramid.levels[l - 1], prevLevelWidth, prevLevelHeight, pyramid.levels[l]);
+        pyramid.sizes[l] = {pyramidLevelSize(prevLevelWidth), pyramidLevelSize(prevLevelHeight)};
+    }
+
+    if (!computeGradients) {
+        pyramid.gradX.clear();
+        pyramid.gradY.clear();
+        return;
+    }
+
+    pyramid.gradX.resize(levels);
+    pyramid.gradY.resize(levels);
+    for (int l = 0; l < levels; l++) {
+        sobelGradients(pyramid.levels[l], pyramid.sizes[l].first, pyramid.sizes[l].second, pyramid.gradX[l], pyramid.gradY[l]);
+    }
+}
+
+// Samples a size x size patch whose top-left corner sits at (x, y) with quantized bilinear weights,
+// results are shifted right by shift bits. Windows that cross the border replicate the nearest valid pixel.
+template <typename Pixel>
+static void samplePatch(const std::vector<Pixel> &image, int width, int height, float x, float y, int size, int shift, int16_t *patch) {
+    const float floorX = std::floor(x);
+    const float floorY = std::floor(y);
+    const int left = static_cast<int>(floorX);
+    const int top = static_cast<int>(floorY);
+    const float ax = x - floorX;
+    const float ay = y - floorY;
+
+    const int w00 = static_cast<int>(std::lround((1.0f - ax) * (1.0f - ay) * (1 << weightBits)));
+    const int w01 = static_cast<int>(std::lround(ax * (1.0f - ay) * (1 << weightBits)));
+    const int w10 = static_cast<int>(std::lround((1.0f - ax) * ay * (1 << weightBits)));
+    const int w11 = (1 << weightBits) - w00 - w01 - w10;
+    const int round = shift > 0 ? 1 << (shift - 1) : 0;
+
+    const bool inside = left >= 0 && top >= 0 && left + size < width && top + size < height;
+    for (int j = 0; j < size; j++) {
+        int16_t *out = &patch[j * size];
+
+        if (inside) {
+            const Pixel *row0 = &image[left + (top + j) * width];
+            const Pixel *row1 = row0 + width;
+            for (int i = 0; i < size; i++) {
+                out[i] = static_cast<int16_t>((row0[i] * w00 + row0[i + 1] * w01 + row1[i] * w10 + row1[i + 1] * w11 + round) >> shift);
+            }
+            continue;
+        }
+
+        const int y0 = std::clamp(top + j, 0, height - 1);
+        const int y1 = std::clamp(top + j + 1, 0, height - 1);
+        for (int i = 0; i < size; i++) {
+            const int x0 = std::clamp(left + i, 0, width - 1);
+            const int x1 = std::clamp(left + i + 1, 0, width - 1);
+            out[i] = static_cast<int16_t>((image[x0 + y0 * width] * w00 + image[x1 + y0 * width] * w01
+                                         + image[x0 + y1 * width] * w10 + image[x1 + y1 * width] * w11 + round) >> shift);
+        }
+    }
+}
+
+// Refines flow on one pyramid level like the double tracker, only the finest level marks features lost
+static void trackFeaturesLevel8u(const std::vector<uint8_t> &prev, const std::vector<int16_t> &gradX, const std::vector<int16_t> &gradY, const std::vector<uint8_t> &next, int width, int height, const std::vector<Vector2f> &features, std::vector<Vector2f> &flow, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error, bool finest) {
+    const int maxIterations = 20;
+    const float sqEpsilon = 0.01f * 0.01f;
+    const int halfWindow = windowSize / 2;
+    const int size = 2 * halfWindow + 1;
+    const int area = size * size;
+    // The double tracker's determinant criterion expressed in 8-bit intensities
+    const double minDeterminant = 1e-7 * std::pow(255.0, 4);
+
+    std::vector<int16_t> patch(area), patchX(area), patchY(area), warped(area);
+
+    for (int f = 0; f < features.size(); f++) {
+        if (!status[f]) continue;
+
+        const float featureX = features[f].x;
+        const float featureY = features[f].y;
+        if (featureX < 0 || featureY < 0 || featureX > width - 1 || featureY > height - 1) {
+            if (finest) status[f] = 0;
+            continue;
+        }
+
+        samplePatch(prev, width, height, featureX - halfWindow, featureY - halfWindow, size, weightBits - intensityBits, patch.data());
+        samplePatch(gradX, width, height, featureX - halfWindow, featureY - halfWindow, size, weightBits, patchX.data());
+        samplePatch(gradY, width, height, featureX - halfWindow, featureY - halfWindow, size, weightBits, patchY.data());
+
+        // Row sums stay within int32, the window total is widened
+        int64_t sumIx2 = 0, sumIxIy = 0, sumIy2 = 0;
+        for (int j = 0; j < size; j++) {
+            const int16_t *Ix = &patchX[j * size];
+            const int16_t *Iy = &patchY[j * size];
+            int32_t rowIx2 = 0, rowIxIy = 0, rowIy2 = 0;
+            for (int i = 0; i < size; i++) {
+                rowIx2 += Ix[i] * Ix[i];
+                rowIxIy += Ix[i] * Iy[i];
+                rowIy2 += Iy[i] * Iy[i];
+            }
+            sumIx2 += rowIx2;
+            sumIxIy += rowIxIy;
+            sumIy2 += rowIy2;
+        }
+
+        // Sobel gradients carry a factor of 8 compared to the normalized double tracker
+        const double Ix2 = sumIx2 / 64.0;
+        const double IxIy = sumIxIy / 64.0;
+        const double Iy2 = sumIy2 / 64.0;
+        const double determinant = Ix2 * Iy2 - IxIy * IxIy;
+        if (std::abs(determinant) < minDeterminant) {
+            if (finest) status[f] = 0;
+            continue;
+        }
+        const double invDeterminant = 1.0 / determinant;
+
+        float u = flow[f].x;
+        float v = flow[f].y;
+        int64_t residual = 0;
+        for (int iteration = 0; iteration < maxIterations; iteration++) {
+            samplePatch(next, width, height, featureX + u - halfWindow, featureY + v - halfWindow, size, weightBits - intensityBits, warped.data());
+
+            int64_t sumIxIt = 0, sumIyIt = 0;
+            residual = 0;
+            for (int j = 0; j < size; j++) {
+                const int16_t *I = &patch[j * size];
+                const int16_t *J = &warped[j * size];
+                const int16_t *Ix = &patchX[j * size];
+                const int16_t *Iy = &patchY[j * size];
+                int32_t rowIxIt = 0, rowIyIt = 0, rowResidual = 0;
+                for (int i = 0; i < size; i++) {
+                    const int32_t It = J[i] - I[i];
+                    rowIxIt += Ix[i] * It;
+                    rowIyIt += Iy[i] * It;
+                    rowResidual += std::abs(It);
+                }
+                sumIxIt += rowIxIt;
+                sumIyIt += rowIyIt;
+                residual += rowResidual;
+            }
+
+            // Undo the gradient and fractional intensity scaling, the sign flips It to -It
+            const double IxIt = -sumIxIt / (8.0 * (1 << intensityBits));
+            const double IyIt = -sumIyIt / (8.0 * (1 << intensityBits));
+            const float du = static_cast<float>(invDeterminant * (Iy2 * IxIt - IxIy * IyIt));
+            const float dv = static_cast<float>(invDeterminant * (-IxIy * IxIt + Ix2 * IyIt));
+            u += du;
+            v += dv;
+
+            if (du * du + dv * dv < sqEpsilon) break;
+        }
+
+        const float trackedX = featureX + u;
+        const float trackedY = featureY + v;
+        if (trackedX < 0 || trackedY < 0 || trackedX > width - 1 || trackedY > height - 1) {
+            if (finest) status[f] = 0;
+            continue;
+        }
+
+        flow[f] = {u, v};
+        // Mean absolute intensity difference in 8-bit units, measured at the start of the final iteration
+        error[f] = static_cast<float>(residual) / ((1 << intensityBits) * area);
+    }
+}
+
+static std::vector<Vector2f> trackFeaturesPyramid8u(const ImagePyramid8u &prevPyramid, const ImagePyramid8u &nextPyramid, const std::vector<Vector2f> &features, int windowSize, std::vector<uint8_t> &status, std::vector<float> &error) {
+    const int levels = std::min(prevPyramid.levels.size(), nextPyramid.levels.size());
+    std::vector<Vector2f> flow(features.size(), {0.0f, 0.0f});
+    std::vector<Vector2f> levelFeatures(features.size());
+
+    for (int l = levels - 1; l >= 0; l--) {
+        TRACE_SCOPE(trace, "lucasKanadeLevel", features.size() * 4 * windowSize * windowSize * sizeof(int16_t));
+        TRACE_FEATURES(trace, features.size());
+        const float scale = 1.0f / static_cast<float>(1 << l);
+        for (int f = 0; f < features.size(); f++) {
+            levelFeatures[f] = {features[f].x * scale, features[f].y * scale};
+        }
+
+        trackFeaturesLevel8u(prevPyramid.levels[l], prevPyramid.gradX[l], prevPyramid.gradY[l], nextPyramid.levels[l], prevPyramid.sizes[l].first, prevPyramid.sizes[l].second, levelFeatures, flow, windowSize, status, error, l == 0);
+
+        if (l > 0) {
+            for (auto &displacement : flow) {
+                displacement.x *= 2;
+                displacement.y *= 2;
+            }
+        }
+    }
+
+    std::vector<Vector2f> output(features.size());
+    for (int f = 0; f < features.size(); f++) {
+        output[f] = {features[f].x + flow[f].x, features[f].y + flow[f].y};
+    }
+    return output;
+}
+
+void lucasKanadeOpticalFlowPyramid(const ImagePyramid8u &prev, const ImagePyramid8u &next, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold) {
+    status.assign(features.size(), 1);
+    error.assign(features.size(), 0.0f);
+
+    // Tracking reads the gradients of prev, and those of next to track backwards. Pyramids built without them lose
+    // every feature instead of being read out of bounds.
+    if (prev.gradX.size() < prev.levels.size() || (forwardBackwardThreshold > 0 && next.gradX.size() < next.levels.size())) {
+        tracked = features;
+        status.assign(features.size(), 0);
+        return;
+    }
+
+    tracked = trackFeaturesPyramid8u(prev, next, features, windowSize, status, error);
+
+    if (forwardBackwardThreshold > 0) {
+        std::vector<uint8_t> backStatus(status);
+        std::vector<float> backError(features.size());
+        auto backTracked = trackFeaturesPyramid8u(next, prev, tracked, windowSize, backStatus, backError);
+        forwardBackwardCheck(features, backTracked, backStatus, forwardBackwardThreshold, status);
+    }
+}
+
+void lucasKanadeOpticalFlowPyramid(const std::vector<uint8_t> &prev, const std::vector<uint8_t> &next, int width, int height, int levels, const std::vector<Vector2f> &features, int windowSize, std::vector<Vector2f> &tracked, std::vector<uint8_t> &status, std::vector<float> &error, float forwardBackwardThreshold) {
+    ImagePyramid8u prevPyramid, nextPyramid;
+    buildImagePyramid(prev, width, height, levels, prevPyramid);
+    // Gradients of the next frame are only needed to track backwards
+    buildImagePyramid(next, width, height, levels, nextPyramid, forwardBackwardThreshold > 0);
+
+    lucasKanadeOpticalFlowPyramid(prevPyramid, nextPyramid, features, windowSize, tracked, status, error, forwardBackwardThreshold);
+}
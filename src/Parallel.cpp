@@ -0,0 +1,95 @@
+#include "Parallel.h"
+#include "Topology.h"
+#include <cstdint>
+#include <sys/mman.h>
+#include <unistd.h>
+
+WorkerPool &WorkerPool::instance() {
+    static WorkerPool pool([]() {
+        std::vector<int> cpus;
+        for (const auto &node : numaNodeCpus()) cpus.insert(cpus.end(), node.begin(), node.end());
+        return cpus;
+    }());
+    return pool;
+}
+
+WorkerPool::WorkerPool(const std::vector<int> &cpus) {
+    for (size_t i = 0; i < std::max<size_t>(1, cpus.size()); i++) workers.push_back(std::make_unique<Worker>());
+    for (size_t i = 0; i < workers.size(); i++) {
+        const int cpu = i < cpus.size() ? cpus[i] : -1;
+        workers[i]->thread = std::thread(&WorkerPool::work, this, std::ref(*workers[i]), cpu);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    for (auto &worker : workers) {
+        {
+            std::lock_guard lock(worker->mutex);
+            worker->stopping = true;
+        }
+        worker->wake.notify_one();
+    }
+    for (auto &worker : workers) worker->thread.join();
+}
+
+void WorkerPool::work(Worker &worker, int cpu) {
+    // A worker that cannot be pinned still works, it only loses its place on the node
+    if (cpu >= 0) pinCurrentThread({cpu});
+    // Nested parallelFor calls run inline, a worker waiting on other workers could deadlock the pool
+    parallelForInline = true;
+
+    while (true) {
+        Task task;
+        {
+            std::unique_lock lock(worker.mutex);
+            worker.wake.wait(lock, [&]() { return worker.stopping || !worker.tasks.empty(); });
+            if (worker.tasks.empty()) return;
+            task = worker.tasks.front();
+            worker.tasks.pop_front();
+        }
+
+        std::exception_ptr error;
+        try {
+            task.function(task.context, task.index);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard lock(task.batch->mutex);
+        if (error && !task.batch->error) task.batch->error = error;
+        if (--task.batch->remaining == 0) task.batch->done.notify_all();
+    }
+}
+
+void WorkerPool::run(int taskCount, Function function, void *context) {
+    Batch batch;
+    batch.remaining = taskCount;
+    for (int t = 0; t < taskCount; t++) {
+        Worker &worker = *workers[t % workers.size()];
+        {
+            std::lock_guard lock(worker.mutex);
+            worker.tasks.push_back({function, context, t, &batch});
+        }
+        worker.wake.notify_one();
+    }
+
+    std::unique_lock lock(batch.mutex);
+    batch.done.wait(lock, [&]() { return batch.remaining == 0; });
+    if (batch.error) std::rethrow_exception(batch.error);
+}
+
+void WorkerPool::placePages(void *data, size_t bytes) {
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    const uintptr_t first = (reinterpret_cast<uintptr_t>(data) + page - 1) & ~(page - 1);
+    const uintptr_t last = (reinterpret_cast<uintptr_t>(data) + bytes) & ~(page - 1);
+    const size_t pages = last > first ? (last - first) / page : 0;
+    // Bands of only a few pages gain nothing from moving and all of them land on one node anyway with a single worker
+    if (size() == 1 || parallelForInline || pages < static_cast<size_t>(size()) * 16) return;
+
+    if (madvise(reinterpret_cast<void *>(first), pages * page, MADV_DONTNEED) != 0) return;
+    auto touch = [&](int t) {
+        for (size_t p = pages * t / size(); p < pages * (t + 1) / size(); p++) {
+            *reinterpret_cast<volatile char *>(first + p * page) = 0;
+        }
+    };
+    run(size(), touch);
+}
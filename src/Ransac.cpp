@@ -0,0 +1,205 @@
+#include "Ransac.h"
+
+// Centroids of both point sets, the fits below work on centered coordinates for conditioning
+static void centroids(const Vector2f *prev, const Vector2f *next, int count, Eigen::Vector2d &prevCenter, Eigen::Vector2d &nextCenter) {
+    prevCenter.setZero();
+    nextCenter.setZero();
+    for (int i = 0; i < count; i++) {
+        prevCenter += Eigen::Vector2d(prev[i].x, prev[i].y);
+        nextCenter += Eigen::Vector2d(next[i].x, next[i].y);
+    }
+    prevCenter /= count;
+    nextCenter /= count;
+}
+
+bool TranslationModel::fit(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform) {
+    if (count < sampleSize) return false;
+    Eigen::Vector2d prevCenter, nextCenter;
+    centroids(prev, next, count, prevCenter, nextCenter);
+    transform.setIdentity();
+    transform.topRightCorner<2, 1>() = nextCenter - prevCenter;
+    return true;
+}
+
+bool SimilarityModel::fit(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform) {
+    if (count < sampleSize) return false;
+    Eigen::Vector2d prevCenter, nextCenter;
+    centroids(prev, next, count, prevCenter, nextCenter);
+
+    // q = [a -b; b a] p + t, closed form on centered points
+    double spread = 0, dot = 0, cross = 0;
+    for (int i = 0; i < count; i++) {
+        const double px = prev[i].x - prevCenter.x(), py = prev[i].y - prevCenter.y();
+        const double qx = next[i].x - nextCenter.x(), qy = next[i].y - nextCenter.y();
+        spread += px * px + py * py;
+        dot += px * qx + py * qy;
+        cross += px * qy - py * qx;
+    }
+    // Every point in the same place leaves rotation and scale undetermined
+    if (spread < 1e-9) return false;
+
+    const double a = dot / spread;
+    const double b = cross / spread;
+    Eigen::Matrix2d linear {{a, -b}, {b, a}};
+    transform.setIdentity();
+    transform.topLeftCorner<2, 2>() = linear;
+    transform.topRightCorner<2, 1>() = nextCenter - linear * prevCenter;
+    return true;
+}
+
+bool AffineModel::fit(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform) {
+    if (count < sampleSize) return false;
+    Eigen::Vector2d prevCenter, nextCenter;
+    centroids(prev, next, count, prevCenter, nextCenter);
+
+    // Normal equations of q = A p + t on centered points: A = C S^-1 with S = sum p p^T and C = sum q p^T
+    Eigen::Matrix2d S = Eigen::Matrix2d::Zero();
+    Eigen::Matrix2d C = Eigen::Matrix2d::Zero();
+    for (int i = 0; i < count; i++) {
+        const Eigen::Vector2d p(prev[i].x - prevCenter.x(), prev[i].y - prevCenter.y());
+        const Eigen::Vector2d q(next[i].x - nextCenter.x(), next[i].y - nextCenter.y());
+        S += p * p.transpose();
+        C += q * p.transpose();
+    }
+    // Collinear points leave the direction across the line undetermined
+    const double trace = S.trace();
+    if (trace < 1e-9 || S.determinant() < 1e-9 * trace * trace) return false;
+
+    const Eigen::Matrix2d linear = C * S.inverse();
+    transform.setIdentity();
+    transform.topLeftCorner<2, 2>() = linear;
+    transform.topRightCorner<2, 1>() = nextCenter - linear * prevCenter;
+    return true;
+}
+
+// Similarity taking the points to their centroid at a mean distance of sqrt(2), Hartley's normalization for the DLT
+static Eigen::Matrix3d normalization(const Vector2f *points, int count, const Eigen::Vector2d &center) {
+    double distance = 0;
+    for (int i = 0; i < count; i++) distance += std::hypot(points[i].x - center.x(), points[i].y - center.y());
+    distance /= count;
+    const double scale = distance > 1e-12 ? std::sqrt(2.0) / distance : 1.0;
+    Eigen::Matrix3d transform {
+        {scale, 0, -scale * center.x()},
+        {0, scale, -scale * center.y()},
+        {0, 0, 1},
+    };
+    return transform;
+}
+
+// Three points on a line make a four point sample degenerate
+static bool collinear(const Vector2f &a, const Vector2f &b, const Vector2f &c) {
+    const double cross = (static_cast<double>(b.x) - a.x) * (static_cast<double>(c.y) - a.y) - (static_cast<double>(b.y) - a.y) * (static_cast<double>(c.x) - a.x);
+    return std::abs(cross) < 1e-6;
+}
+
+static bool collinearSample(const Vector2f *points) {
+    for (int i = 0; i < 4; i++) {
+        if (collinear(points[i], points[(i + 1) % 4], points[(i + 2) % 4])) return true;
+    }
+    return false;
+}
+
+bool HomographyModel::fitMinimal(const Vector2f *prev, const Vector2f *next, Eigen::Matrix3d &transform) {
+    if (collinearSample(prev) || collinearSample(next)) return false;
+
+    Eigen::Vector2d prevCenter, nextCenter;
+    centroids(prev, next, sampleSize, prevCenter, nextCenter);
+    const Eigen::Matrix3d prevNormalization = normalization(prev, sampleSize, prevCenter);
+    const Eigen::Matrix3d nextNormalization = normalization(next, sampleSize, nextCenter);
+
+    Eigen::Matrix<double, 8, 8> A;
+    Eigen::Matrix<double, 8, 1> b;
+    for (int i = 0; i < sampleSize; i++) {
+        const Eigen::Vector3d p = prevNormalization * Eigen::Vector3d(prev[i].x, prev[i].y, 1);
+        const Eigen::Vector3d q = nextNormalization * Eigen::Vector3d(next[i].x, next[i].y, 1);
+        A.row(2 * i) << p.x(), p.y(), 1, 0, 0, 0, -q.x() * p.x(), -q.x() * p.y();
+        A.row(2 * i + 1) << 0, 0, 0, p.x(), p.y(), 1, -q.y() * p.x(), -q.y() * p.y();
+        b(2 * i) = q.x();
+        b(2 * i + 1) = q.y();
+    }
+    const Eigen::PartialPivLU<Eigen::Matrix<double, 8, 8>> lu(A);
+    if (std::abs(lu.determinant()) < 1e-12) return false;
+    const Eigen::Matrix<double, 8, 1> h = lu.solve(b);
+
+    Eigen::Matrix3d normalized;
+    normalized << h(0), h(1), h(2), h(3), h(4), h(5), h(6), h(7), 1;
+    const Eigen::Matrix3d homography = nextNormalization.inverse() * normalized * prevNormalization;
+    if (std::abs(homography(2, 2)) < 1e-12 || std::abs(homography.determinant()) < 1e-12) return false;
+    transform = homography / homography(2, 2);
+    return true;
+}
+
+bool HomographyModel::fit(const Vector2f *prev, const Vector2f *next, int count, Eigen::Matrix3d &transform) {
+    if (count < sampleSize) return false;
+    if (count == sampleSize && (collinearSample(prev) || collinearSample(next))) return false;
+
+    Eigen::Vector2d prevCenter, nextCenter;
+    centroids(prev, next, count, prevCenter, nextCenter);
+    const Eigen::Matrix3d prevNormalization = normalization(prev, count, prevCenter);
+    const Eigen::Matrix3d nextNormalization = normalization(next, count, nextCenter);
+
+    // Every correspondence adds two rows to A h = 0. The solution is the eigenvector of A^T A with the smallest
+    // eigenvalue, accumulating the 9x9 product keeps memory independent of count.
+    Eigen::Matrix<double, 9, 9> normal = Eigen::Matrix<double, 9, 9>::Zero();
+    for (int i = 0; i < count; i++) {
+        const Eigen::Vector3d p = prevNormalization * Eigen::Vector3d(prev[i].x, prev[i].y, 1);
+        const Eigen::Vector3d q = nextNormalization * Eigen::Vector3d(next[i].x, next[i].y, 1);
+        Eigen::Matrix<double, 9, 1> u, v;
+        u << p.x(), p.y(), 1, 0, 0, 0, -q.x() * p.x(), -q.x() * p.y(), -q.x();
+        v << 0, 0, 0, p.x(), p.y(), 1, -q.y() * p.x(), -q.y() * p.y(), -q.y();
+        normal.selfadjointView<Eigen::Lower>().rankUpdate(u);
+        normal.selfadjointView<Eigen::Lower>().rankUpdate(v);
+    }
+    const Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 9, 9>> solver(normal.selfadjointView<Eigen::Lower>());
+    if (solver.info() != Eigen::Success) return false;
+    // A second null direction means the points do not pin the homography down
+    const auto &eigenvalues = solver.eigenvalues();
+    if (eigenvalues(1) <= 1e-12 * eigenvalues(8)) return false;
+
+    const Eigen::Matrix<double, 9, 1> h = solver.eigenvectors().col(0);
+    Eigen::Matrix3d normalized;
+    normalized << h(0), h(1), h(2), h(3), h(4), h(5), h(6), h(7), h(8);
+    Eigen::Matrix3d homography = nextNormalization.inverse() * normalized * prevNormalization;
+    if (std::abs(homography(2, 2)) < 1e-12 || std::abs(homography.determinant()) < 1e-12) return false;
+    transform = homography / homography(2, 2);
+    return true;
+}
+
+// One estimator per model and thread, so its buffers are reused from frame to frame instead of being allocated and
+// faulted in again for every estimate
+template <typename Model>
+static Eigen::Matrix3d estimateWithCachedRansac(const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts, const RansacOptions &options) {
+    thread_local Ransac<Model> estimator;
+    estimator.setOptions(options);
+    return estimator.estimate(prevPts, nextPts).transform;
+}
+
+Eigen::Matrix3d estimateMotionModel(const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts, MotionModel model, float reprojectionThreshold) {
+    RansacOptions options;
+    options.threshold = reprojectionThreshold;
+    switch (model) {
+    case MotionModel::Translation: return estimateWithCachedRansac<TranslationModel>(prevPts, nextPts, options);
+    case MotionModel::Similarity: return estimateWithCachedRansac<SimilarityModel>(prevPts, nextPts, options);
+    case MotionModel::Affine: return estimateWithCachedRansac<AffineModel>(prevPts, nextPts, options);
+    case MotionModel::Homography: return estimateWithCachedRansac<HomographyModel>(prevPts, nextPts, options);
+    }
+    return Eigen::Matrix3d::Identity();
+}
+
+int motionModelSampleSize(MotionModel model) {
+    switch (model) {
+    case MotionModel::Translation: return TranslationModel::sampleSize;
+    case MotionModel::Similarity: return SimilarityModel::sampleSize;
+    case MotionModel::Affine: return AffineModel::sampleSize;
+    case MotionModel::Homography: return HomographyModel::sampleSize;
+    }
+    return 0;
+}
+
+Eigen::Matrix<double, 2, 3> estimateAffineTransform(const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts, float reprojectionThreshold) {
+    return estimateMotionModel(prevPts, nextPts, MotionModel::Affine, reprojectionThreshold).topRows<2>();
+}
+
+Eigen::Matrix3d estimateHomography(const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts, float reprojectionThreshold) {
+    return estimateMotionModel(prevPts, nextPts, MotionModel::Homography, reprojectionThreshold);
+}
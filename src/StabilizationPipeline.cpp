@@ -0,0 +1,618 @@
+#include "StabilizationPipeline.h"
+#include "FrameArena.h"
+#include "FrameCache.h"
+#include "FrameRing.h"
+#include "Parallel.h"
+#include "SpscQueue.h"
+#include "Topology.h"
+#include "Trace.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Everything one frame carries through the pipeline, owned by exactly one stage at a time. Frames live in ring slots
+// that are reused for the whole run, so every buffer here is allocated once and then only refilled.
+struct PipelineFrame {
+    int index = 0;
+    std::vector<double> image;
+    // Borrowed from the cache pool between the pyramid and tracking stages, later stages only need the image
+    FrameCache *cache = nullptr;
+    // Correspondences from the previous frame, filled by the tracking stage
+    std::vector<Vector2f> prevPts;
+    std::vector<Vector2f> nextPts;
+    FrameMotion motion;
+    std::vector<double> stabilized;
+    std::chrono::steady_clock::time_point decodedAt;
+    std::chrono::steady_clock::time_point trackedAt;
+};
+
+using FrameSlots = FrameRing<PipelineFrame>;
+// Links between stages carry slot indices, never more than the ring has slots so pushes never wait
+using SlotQueue = SpscQueue<int>;
+// Free caches flow back from the tracking stage to the pyramid stage
+using CachePool = SpscQueue<FrameCache *>;
+
+// Exponential moving average, seeded by the first sample
+static void updateAverage(double &average, double sample) {
+    average = average == 0 ? sample : 0.8 * average + 0.2 * sample;
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// What the tracking stage measured on recent frames, the live mode predicts the cost of each rung from it
+struct TrackingCosts {
+    double detectMs = 0;
+    double detectedPoints = 0;
+    // Per point and pyramid level, forward-backward checking included
+    double trackMsPerPoint = 0;
+    // From leaving the tracking stage to reaching the sink, written by the encode stage
+    std::atomic<double> downstreamMs = 0;
+};
+
+struct TrackingPlan {
+    bool detect = true;
+    bool reduceFeatures = false;
+    int levels = 0;
+    bool reuseTransform = false;
+    uint32_t degradations = 0;
+};
+
+// Walks down the degradation ladder until the predicted cost of the frame fits what is left of its budget
+static TrackingPlan planTracking(const TrackingCosts &costs, double remainingMs, size_t carriedPoints, int levels) {
+    TrackingPlan plan;
+    plan.levels = levels;
+    auto predictedMs = [&]() {
+        const double points = (plan.detect ? costs.detectedPoints : carriedPoints) * (plan.reduceFeatures ? 0.5 : 1.0);
+        return (plan.detect ? costs.detectMs : 0.0) + points * plan.levels * costs.trackMsPerPoint;
+    };
+    if (predictedMs() <= remainingMs) return plan;
+
+    // Carried points thin out with every frame, past half of a fresh detection they no longer support the estimate
+    if (carriedPoints >= 8 && carriedPoints >= costs.detectedPoints / 2) {
+        plan.detect = false;
+        plan.degradations |= static_cast<uint32_t>(Degradation::SkipDetection);
+        if (predictedMs() <= remainingMs) return plan;
+    }
+
+    plan.reduceFeatures = true;
+    plan.degradations |= static_cast<uint32_t>(Degradation::ReduceFeatures);
+    if (predictedMs() <= remainingMs) return plan;
+
+    if (levels > 1) {
+        plan.levels = levels - 1;
+        plan.degradations |= static_cast<uint32_t>(Degradation::DropPyramidLevel);
+        if (predictedMs() <= remainingMs) return plan;
+    }
+
+    TrackingPlan reuse;
+    reuse.reuseTransform = true;
+    reuse.degradations = static_cast<uint32_t>(Degradation::ReuseTransform);
+    return reuse;
+}
+
+// Translation and rotation of a frame to frame motion, the parameters the camera path is accumulated in
+static Eigen::Vector3d motionParameters(const Eigen::Matrix<double, 2, 3> &motion) {
+    return {motion(0, 2), motion(1, 2), std::atan2(motion(1, 0), motion(0, 0))};
+}
+
+static Eigen::Matrix<double, 2, 3> rigidTransform(const Eigen::Vector3d &parameters) {
+    const double c = std::cos(parameters(2));
+    const double s = std::sin(parameters(2));
+    Eigen::Matrix<double, 2, 3> transform;
+    transform << c, -s, parameters(0),
+                 s, c, parameters(1);
+    return transform;
+}
+
+// Builds the frame cache on the motion level, the full resolution planes are never built when it is above zero
+static void setMotionFrame(const StabilizerOptions &options, const std::vector<double> &image, int width, int height, FrameCache &cache, std::vector<double> &motionImage, FrameArena &arena) {
+    if (options.motionLevel <= 0) {
+        cache.setFrame(image, width, height, options.levels);
+        return;
+    }
+    int motionWidth, motionHeight;
+    downscaleImage(image, width, height, options.motionLevel, motionImage, motionWidth, motionHeight, arena);
+    cache.setFrame(motionImage, motionWidth, motionHeight, options.levels);
+}
+
+static void detectFeatures(const StabilizerOptions &options, FrameCache &cache, std::vector<Vector2f> &features, FrameArena &arena) {
+    if (options.gridSize > 0) {
+        goodFeaturesToTrackBucketed(cache, options.qualityLevel, options.minimumDistance, options.gridSize, options.gridSize, options.maxFeaturesPerTile, features, arena);
+    } else {
+        goodFeaturesToTrack(cache, options.qualityLevel, options.minimumDistance, features, arena);
+    }
+}
+
+// Full resolution motion between the frames. Too few correspondences for a hypothesis of the model leave the identity,
+// the camera is assumed to hold still.
+static Eigen::Matrix<double, 2, 3> estimateMotion(const StabilizerOptions &options, const std::vector<Vector2f> &prevPts, const std::vector<Vector2f> &nextPts) {
+    const MotionModel model = options.motionModel == MotionModel::Homography ? MotionModel::Affine : options.motionModel;
+    if (static_cast<int>(prevPts.size()) < motionModelSampleSize(model)) return Eigen::Matrix<double, 2, 3>::Identity();
+    const Eigen::Matrix<double, 2, 3> motion = estimateMotionModel(prevPts, nextPts, model, options.reprojectionThreshold).topRows<2>();
+    return scaleAffineTransform(motion, 1 << std::max(0, options.motionLevel));
+}
+
+// Moves frame k of the accumulated camera path onto the average of its window
+static Eigen::Matrix<double, 2, 3> smoothedCorrection(const std::vector<Eigen::Vector3d> &trajectory, int k, int radius, int lookahead) {
+    const int first = std::max(0, k - radius);
+    const int last = std::min(static_cast<int>(trajectory.size()) - 1, k + lookahead);
+    Eigen::Vector3d smoothed = Eigen::Vector3d::Zero();
+    for (int j = first; j <= last; j++) smoothed += trajectory[j];
+    smoothed /= last - first + 1;
+    return rigidTransform(smoothed - trajectory[k]);
+}
+
+static int decodeStage(int width, int height, const FrameSource &source, FrameSlots &slots) {
+    int decoded = 0;
+    while (true) {
+        const int slot = slots.acquire();
+        if (slot < 0) break;
+
+        PipelineFrame &frame = slots[slot];
+        TRACE_FRAME(decoded);
+        TRACE_SCOPE(trace, "decodeStage", width * height * sizeof(double));
+        frame.image.resize(width * height);
+        // The slot is simply never published, an unreleased slot only matters while the ring is open
+        if (!source(frame.image)) break;
+        // A live source blocks until the camera delivers, the frame's budget starts once it has
+        frame.decodedAt = std::chrono::steady_clock::now();
+        frame.index = decoded++;
+        slots.publish(slot);
+    }
+    slots.close();
+    return decoded;
+}
+
+// Everything that depends on a single frame only: pyramid, gradients and the detection structure tensor
+static void pyramidStage(int width, int height, const StabilizerOptions &options, FrameSlots &slots, CachePool &caches, SlotQueue &output) {
+    FrameArena arena;
+    std::vector<double> motionImage;
+    int slot;
+    while ((slot = slots.consume()) >= 0) {
+        PipelineFrame &frame = slots[slot];
+        TRACE_FRAME(frame.index);
+        if (!caches.pop(frame.cache)) break;
+        {
+            TRACE_SCOPE(trace, "pyramidStage", width * height * sizeof(double));
+            arena.reset();
+            setMotionFrame(options, frame.image, width, height, *frame.cache, motionImage, arena);
+            frame.cache->pyramid();
+            frame.cache->structureTensor(2);
+        }
+        if (!output.push(slot)) break;
+    }
+    output.close();
+}
+
+// Detects on the previous frame and tracks into the current one. Only the previous frame's cache and surviving points
+// are held back, the frame itself moves on as soon as its motion is known.
+static void trackStage(const StabilizerOptions &options, FrameSlots &slots, CachePool &caches, TrackingCosts &costs, SlotQueue &input, SlotQueue &output) {
+    FrameArena arena;
+    std::vector<uint8_t> status;
+    std::vector<float> error;
+    FrameCache *previousCache = nullptr;
+    std::vector<Vector2f> carried;
+
+    int slot;
+    while (input.pop(slot)) {
+        PipelineFrame &frame = slots[slot];
+        TRACE_FRAME(frame.index);
+        frame.prevPts.clear();
+        frame.nextPts.clear();
+        frame.motion = FrameMotion {};
+
+        if (previousCache) {
+            TRACE_SCOPE(trace, "trackStage", 0);
+            const int levels = std::min(previousCache->levels(), frame.cache->levels());
+            TrackingPlan plan;
+            plan.levels = levels;
+            if (options.frameBudgetMs > 0) {
+                const double remainingMs = options.frameBudgetMs - elapsedMs(frame.decodedAt) - costs.downstreamMs.load(std::memory_order_relaxed);
+                plan = planTracking(costs, remainingMs, carried.size(), levels);
+            }
+            frame.motion.degradations = plan.degradations;
+
+            if (!plan.reuseTransform) {
+                arena.reset();
+                if (plan.detect) {
+                    const auto start = std::chrono::steady_clock::now();
+                    detectFeatures(options, *previousCache, frame.prevPts, arena);
+                    updateAverage(costs.detectMs, elapsedMs(start));
+                    updateAverage(costs.detectedPoints, frame.prevPts.size());
+                } else {
+                    frame.prevPts = carried;
+                }
+
+                if (plan.reduceFeatures) {
+                    for (size_t i = 0; 2 * i < frame.prevPts.size(); i++) frame.prevPts[i] = frame.prevPts[2 * i];
+                    frame.prevPts.resize((frame.prevPts.size() + 1) / 2);
+                }
+
+                const auto start = std::chrono::steady_clock::now();
+                lucasKanadeOpticalFlowPyramid(*previousCache, *frame.cache, frame.prevPts, options.windowSize, frame.nextPts, status, error, options.forwardBackwardThreshold, plan.levels);
+                updateAverage(costs.trackMsPerPoint, elapsedMs(start) / std::max<size_t>(1, frame.prevPts.size() * plan.levels));
+                removeRejectedFeatures(frame.prevPts, frame.nextPts, status);
+                TRACE_FEATURES(trace, frame.prevPts.size());
+            }
+
+            carried = frame.nextPts;
+            caches.push(previousCache);
+        }
+
+        previousCache = frame.cache;
+        frame.cache = nullptr;
+        frame.trackedAt = std::chrono::steady_clock::now();
+        if (!output.push(slot)) break;
+    }
+
+    if (previousCache) caches.push(previousCache);
+    output.close();
+}
+
+static void estimateStage(const StabilizerOptions &options, FrameSlots &slots, SlotQueue &input, SlotQueue &output) {
+    Eigen::Matrix<double, 2, 3> previousMotion = Eigen::Matrix<double, 2, 3>::Identity();
+    int slot;
+    while (input.pop(slot)) {
+        PipelineFrame &frame = slots[slot];
+        TRACE_FRAME(frame.index);
+        // A frame that is already late skips RANSAC as well
+        const bool late = options.frameBudgetMs > 0 && frame.index > 0 && elapsedMs(frame.decodedAt) > options.frameBudgetMs;
+        if (frame.motion.degraded(Degradation::ReuseTransform) || late) {
+            frame.motion.motion = previousMotion;
+            frame.motion.degradations |= static_cast<uint32_t>(Degradation::ReuseTransform);
+        } else if (frame.index > 0) {
+            frame.motion.motion = estimateMotion(options, frame.prevPts, frame.nextPts);
+        }
+        frame.motion.trackedFeatures = frame.prevPts.size();
+        previousMotion = frame.motion.motion;
+        if (!output.push(slot)) break;
+    }
+    output.close();
+}
+
+// Moving average of the accumulated camera path, a frame is released once smoothingRadius successors have arrived.
+// Positions on the path count frames that reached this stage, so frames dropped upstream leave no gaps.
+static void smoothStage(const StabilizerOptions &options, FrameSlots &slots, SlotQueue &input, SlotQueue &output) {
+    std::vector<Eigen::Vector3d> trajectory;
+    std::deque<int> pending;
+    int released = 0;
+    const int radius = std::max(0, options.smoothingRadius);
+    // Live mode cannot wait for future frames, the window then only reaches back
+    const int lookahead = options.frameBudgetMs > 0 ? 0 : radius;
+
+    auto release = [&]() {
+        const int slot = pending.front();
+        pending.pop_front();
+
+        {
+            TRACE_FRAME(slots[slot].index);
+            TRACE_SCOPE(trace, "smoothStage", 0);
+            slots[slot].motion.correction = smoothedCorrection(trajectory, released++, radius, lookahead);
+        }
+        return output.push(slot);
+    };
+
+    int slot;
+    while (input.pop(slot)) {
+        const Eigen::Vector3d parameters = trajectory.empty() ? Eigen::Vector3d::Zero() : motionParameters(slots[slot].motion.motion);
+        trajectory.push_back(trajectory.empty() ? parameters : trajectory.back() + parameters);
+        pending.push_back(slot);
+
+        if (static_cast<int>(trajectory.size()) > released + lookahead && !release()) break;
+    }
+
+    while (!pending.empty() && release()) {}
+    output.close();
+}
+
+static void warpStage(int width, int height, FrameSlots &slots, SlotQueue &input, SlotQueue &output) {
+    int slot;
+    while (input.pop(slot)) {
+        PipelineFrame &frame = slots[slot];
+        TRACE_FRAME(frame.index);
+        warpAffine(frame.image, width, height, frame.motion.correction, frame.stabilized);
+        if (!output.push(slot)) break;
+    }
+    output.close();
+}
+
+static void recordTelemetry(const StabilizerOptions &options, const PipelineFrame &frame, TrackingCosts &costs, StabilizerStatistics &statistics) {
+    // Only this thread writes the downstream estimate, the tracking stage merely reads it
+    double downstreamMs = costs.downstreamMs.load(std::memory_order_relaxed);
+    updateAverage(downstreamMs, elapsedMs(frame.trackedAt));
+    costs.downstreamMs.store(downstreamMs, std::memory_order_relaxed);
+
+    const FrameMotion &motion = frame.motion;
+    statistics.skippedDetections += motion.degraded(Degradation::SkipDetection);
+    statistics.reducedFeatures += motion.degraded(Degradation::ReduceFeatures);
+    statistics.droppedPyramidLevels += motion.degraded(Degradation::DropPyramidLevel);
+    statistics.reusedTransforms += motion.degraded(Degradation::ReuseTransform);
+    if (options.frameBudgetMs > 0 && motion.latencyMs > options.frameBudgetMs) statistics.deadlineMisses++;
+}
+
+StabilizerStatistics stabilizeVideo(int width, int height, const StabilizerOptions &options, const FrameSource &source, const FrameSink &sink) {
+    // Slots held inside the stages: the smoothing window and one being worked on per stage
+    const int stageCount = 6;
+    const size_t slotCount = std::max(0, options.smoothingRadius) + 1 + stageCount + std::max(1, options.queueCapacity);
+    FrameSlots slots(slotCount, options.overflowPolicy);
+    SlotQueue built(slotCount), tracked(slotCount), estimated(slotCount), smoothed(slotCount), warped(slotCount);
+
+    // Only the pyramid and tracking stages need derived planes: one cache being filled, the queue between them and
+    // the pair being tracked
+    const size_t cacheCount = std::max(1, options.queueCapacity) + 3;
+    auto cacheStorage = std::make_unique<FrameCache[]>(cacheCount);
+    CachePool caches(cacheCount);
+    for (size_t i = 0; i < cacheCount; i++) {
+        FrameCache *cache = &cacheStorage[i];
+        caches.tryPush(cache);
+    }
+
+    // The first exception any stage throws. Recording it closes the ring, the cache pool and every queue, which
+    // unblocks all stages so they can be joined before it is rethrown.
+    std::mutex failureMutex;
+    std::exception_ptr failure;
+    auto fail = [&]() {
+        {
+            std::lock_guard lock(failureMutex);
+            if (!failure) failure = std::current_exception();
+        }
+        slots.close();
+        caches.close();
+        for (SlotQueue *queue : {&built, &tracked, &estimated, &smoothed, &warped}) queue->close();
+    };
+    auto guarded = [&fail](auto stage) {
+        return [&fail, stage]() {
+            try {
+                stage();
+            } catch (...) {
+                fail();
+            }
+        };
+    };
+
+    StabilizerStatistics statistics;
+    TrackingCosts costs;
+    {
+        // Declared after the queues so the threads are joined before the queues they use are destroyed
+        std::vector<std::jthread> stages;
+        stages.emplace_back(guarded([&]() { statistics.decodedFrames = decodeStage(width, height, source, slots); }));
+        stages.emplace_back(guarded([&]() { pyramidStage(width, height, options, slots, caches, built); }));
+        stages.emplace_back(guarded([&]() { trackStage(options, slots, caches, costs, built, tracked); }));
+        stages.emplace_back(guarded([&]() { estimateStage(options, slots, tracked, estimated); }));
+        stages.emplace_back(guarded([&]() { smoothStage(options, slots, estimated, smoothed); }));
+        stages.emplace_back(guarded([&]() { warpStage(width, height, slots, smoothed, warped); }));
+
+        // The encode stage runs on the caller so the sink needs no synchronization of its own
+        try {
+            int slot;
+            while (warped.pop(slot)) {
+                {
+                    PipelineFrame &frame = slots[slot];
+                    TRACE_FRAME(frame.index);
+                    TRACE_SCOPE(trace, "encodeStage", width * height * sizeof(double));
+                    frame.motion.latencyMs = elapsedMs(frame.decodedAt);
+                    recordTelemetry(options, frame, costs, statistics);
+                    sink(frame.index, frame.stabilized, frame.motion);
+                }
+                slots.release(slot);
+            }
+        } catch (...) {
+            fail();
+        }
+    }
+
+    if (failure) std::rethrow_exception(failure);
+    statistics.droppedFrames = slots.dropped();
+    return statistics;
+}
+
+// Everything a stream needs while it runs. Handed to the next stream through the pool of the node it ran on, so the
+// caches and frame buffers keep their capacity from clip to clip.
+struct StreamBuffers {
+    std::array<FrameCache, 2> caches;
+    FrameArena arena;
+    std::vector<double> motionImage;
+    // Images of frames that reached the sink, refilled by the source
+    std::vector<std::vector<double>> freeImages;
+    std::vector<double> stabilized;
+    std::vector<Vector2f> prevPts;
+    std::vector<Vector2f> nextPts;
+    std::vector<uint8_t> status;
+    std::vector<float> error;
+};
+
+struct BufferedFrame {
+    int index = 0;
+    std::vector<double> image;
+    FrameMotion motion;
+    std::chrono::steady_clock::time_point decodedAt;
+};
+
+struct StreamState {
+    const StreamJob *job = nullptr;
+    int jobIndex = 0;
+    int node = 0;
+    std::unique_ptr<StreamBuffers> buffers;
+    std::vector<Eigen::Vector3d> trajectory;
+    // Frames waiting for smoothingRadius successors
+    std::deque<BufferedFrame> pending;
+    int decoded = 0;
+    int released = 0;
+};
+
+static void releaseFrame(const StabilizerOptions &options, StreamState &stream) {
+    const StreamJob &job = *stream.job;
+    StreamBuffers &buffers = *stream.buffers;
+    BufferedFrame &frame = stream.pending.front();
+    const int radius = std::max(0, options.smoothingRadius);
+
+    TRACE_FRAME(frame.index);
+    frame.motion.correction = smoothedCorrection(stream.trajectory, stream.released++, radius, radius);
+    warpAffine(frame.image, job.width, job.height, frame.motion.correction, buffers.stabilized);
+    frame.motion.latencyMs = elapsedMs(frame.decodedAt);
+    job.sink(frame.index, buffers.stabilized, frame.motion);
+
+    buffers.freeImages.push_back(std::move(frame.image));
+    stream.pending.pop_front();
+}
+
+// Runs up to frameCount frames of the stream through every stage, returns false once it has delivered its last frame
+static bool runStream(const StabilizerOptions &options, StreamState &stream, int frameCount) {
+    const StreamJob &job = *stream.job;
+    StreamBuffers &buffers = *stream.buffers;
+    const int radius = std::max(0, options.smoothingRadius);
+
+    for (int n = 0; n < frameCount; n++) {
+        BufferedFrame frame;
+        if (!buffers.freeImages.empty()) {
+            frame.image = std::move(buffers.freeImages.back());
+            buffers.freeImages.pop_back();
+        }
+        frame.image.resize(job.width * job.height);
+        if (!job.source(frame.image)) {
+            buffers.freeImages.push_back(std::move(frame.image));
+            while (!stream.pending.empty()) releaseFrame(options, stream);
+            return false;
+        }
+        frame.decodedAt = std::chrono::steady_clock::now();
+        frame.index = stream.decoded++;
+        TRACE_FRAME(frame.index);
+
+        // The two caches alternate, the previous frame's stays intact while the current one is built
+        FrameCache &cache = buffers.caches[frame.index % 2];
+        buffers.arena.reset();
+        setMotionFrame(options, frame.image, job.width, job.height, cache, buffers.motionImage, buffers.arena);
+        if (frame.index > 0) {
+            FrameCache &previous = buffers.caches[(frame.index - 1) % 2];
+            detectFeatures(options, previous, buffers.prevPts, buffers.arena);
+            lucasKanadeOpticalFlowPyramid(previous, cache, buffers.prevPts, options.windowSize, buffers.nextPts, buffers.status, buffers.error, options.forwardBackwardThreshold);
+            removeRejectedFeatures(buffers.prevPts, buffers.nextPts, buffers.status);
+            frame.motion.motion = estimateMotion(options, buffers.prevPts, buffers.nextPts);
+            frame.motion.trackedFeatures = buffers.prevPts.size();
+        }
+
+        const Eigen::Vector3d parameters = stream.trajectory.empty() ? Eigen::Vector3d::Zero() : motionParameters(frame.motion.motion);
+        stream.trajectory.push_back(stream.trajectory.empty() ? parameters : stream.trajectory.back() + parameters);
+        stream.pending.push_back(std::move(frame));
+        if (static_cast<int>(stream.trajectory.size()) > stream.released + radius) releaseFrame(options, stream);
+    }
+    return true;
+}
+
+std::vector<StabilizerStatistics> stabilizeBatch(const std::vector<StreamJob> &jobs, const StabilizerOptions &options, const BatchOptions &batch) {
+    const std::vector<std::vector<int>> nodes = numaNodeCpus();
+    const int nodeCount = nodes.size();
+    int cpuCount = 0;
+    for (const auto &cpus : nodes) cpuCount += cpus.size();
+    const int workerCount = std::max(1, std::min<int>(batch.workerCount > 0 ? batch.workerCount : cpuCount, jobs.size()));
+    const int maxActive = batch.maxActiveStreams > 0 ? batch.maxActiveStreams : 2 * workerCount;
+    const int framesPerTurn = std::max(1, batch.framesPerTurn);
+    auto nodeOf = [&](int worker) { return worker % nodeCount; };
+
+    // Turns last many frames, so one lock around all queues and pools is never contended for long
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<std::deque<StreamState *>> queues(workerCount);
+    std::vector<std::vector<std::unique_ptr<StreamBuffers>>> pools(nodeCount);
+    std::vector<std::unique_ptr<StreamState>> streams(jobs.size());
+    std::vector<StabilizerStatistics> statistics(jobs.size());
+    size_t nextJob = 0;
+    int active = 0;
+    std::exception_ptr failure;
+
+    // Called with the lock held: the worker's own queue, then a new job, then the oldest stream of another worker
+    auto takeStream = [&](int worker) -> StreamState * {
+        if (!queues[worker].empty()) {
+            StreamState *stream = queues[worker].front();
+            queues[worker].pop_front();
+            return stream;
+        }
+
+        if (nextJob < jobs.size() && active < maxActive) {
+            const int node = nodeOf(worker);
+            auto stream = std::make_unique<StreamState>();
+            stream->job = &jobs[nextJob];
+            stream->jobIndex = nextJob;
+            stream->node = node;
+            if (pools[node].empty()) {
+                // Empty until the stream's first turn, which this worker runs, sizes the caches and planes, so their
+                // pages land on this node. Frame images first needed in a later turn land wherever the stream runs by
+                // then, on another node only after a steal.
+                stream->buffers = std::make_unique<StreamBuffers>();
+            } else {
+                stream->buffers = std::move(pools[node].back());
+                pools[node].pop_back();
+            }
+            StreamState *admitted = stream.get();
+            streams[nextJob++] = std::move(stream);
+            active++;
+            return admitted;
+        }
+
+        // Another node's stream keeps touching remote buffers, it is only taken once the own node has nothing left
+        for (int pass = 0; pass < 2; pass++) {
+            for (int offset = 1; offset < workerCount; offset++) {
+                const int victim = (worker + offset) % workerCount;
+                if ((nodeOf(victim) == nodeOf(worker)) != (pass == 0) || queues[victim].empty()) continue;
+                StreamState *stream = queues[victim].front();
+                queues[victim].pop_front();
+                return stream;
+            }
+        }
+        return nullptr;
+    };
+
+    auto work = [&](int worker) {
+        if (batch.pinWorkers && nodeCount > 1) pinCurrentThread(nodes[nodeOf(worker)]);
+        // Streams already keep every worker busy, the kernels must not fan out further
+        parallelForInline = true;
+
+        std::unique_lock lock(mutex);
+        while (!failure) {
+            StreamState *stream = takeStream(worker);
+            if (!stream) {
+                if (nextJob == jobs.size() && active == 0) break;
+                wake.wait(lock);
+                continue;
+            }
+
+            lock.unlock();
+            bool running = false;
+            std::exception_ptr error;
+            try {
+                running = runStream(options, *stream, framesPerTurn);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+
+            if (error && !failure) failure = error;
+            if (running) {
+                queues[worker].push_back(stream);
+            } else {
+                statistics[stream->jobIndex].decodedFrames = stream->decoded;
+                pools[stream->node].push_back(std::move(stream->buffers));
+                streams[stream->jobIndex].reset();
+                active--;
+            }
+            wake.notify_all();
+        }
+    };
+
+    {
+        std::vector<std::jthread> workers;
+        for (int worker = 0; worker < workerCount; worker++) workers.emplace_back(work, worker);
+    }
+
+    if (failure) std::rethrow_exception(failure);
+    return statistics;
+}
@@ -0,0 +1,65 @@
+#include "Topology.h"
+#include <fstream>
+#include <sched.h>
+#include <sstream>
+#include <string>
+
+// Parses the kernel's list format, e.g. "0-3,8-11"
+static std::vector<int> parseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.empty() || range == "\n") continue;
+        const size_t dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static bool readCpuList(const std::string &path, std::vector<int> &cpus) {
+    std::ifstream file(path);
+    std::string list;
+    if (!file || !std::getline(file, list)) return false;
+    cpus = parseCpuList(list);
+    return true;
+}
+
+std::vector<std::vector<int>> numaNodeCpus() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    auto isAllowed = [&](int cpu) { return !restricted || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)); };
+
+    std::vector<std::vector<int>> nodes;
+    std::vector<int> online;
+    if (readCpuList("/sys/devices/system/node/online", online)) {
+        for (int node : online) {
+            std::vector<int> cpus;
+            if (!readCpuList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", cpus)) continue;
+            std::erase_if(cpus, [&](int cpu) { return !isAllowed(cpu); });
+            // Memory-only nodes and nodes outside the affinity mask have nothing to run workers on
+            if (!cpus.empty()) nodes.push_back(std::move(cpus));
+        }
+    }
+
+    if (nodes.empty()) {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (restricted ? CPU_ISSET(cpu, &allowed) : cpu == 0) cpus.push_back(cpu);
+        }
+        nodes.push_back(std::move(cpus));
+    }
+    return nodes;
+}
+
+bool pinCurrentThread(const std::vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    return CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
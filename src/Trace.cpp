@@ -0,0 +1,137 @@
+#include "Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iomanip>
+
+static std::atomic<TraceSink *> activeSink = nullptr;
+// Per thread, pipeline stages work on different frames at the same time
+static thread_local uint64_t currentFrame = 0;
+static const auto traceEpoch = std::chrono::steady_clock::now();
+
+// Small sequential ids read better in trace viewers than native thread handles
+static uint32_t traceThreadId() {
+    static std::atomic<uint32_t> nextId = 0;
+    thread_local const uint32_t id = nextId++;
+    return id;
+}
+
+void setTraceSink(TraceSink *sink) {
+    activeSink = sink;
+}
+
+TraceSink *traceSink() {
+    return activeSink;
+}
+
+void setTraceFrame(uint64_t frame) {
+    currentFrame = frame;
+}
+
+uint64_t traceFrame() {
+    return currentFrame;
+}
+
+ScopedTrace::ScopedTrace(const char *name, uint64_t bytes) : name(name), bytes(bytes), start(std::chrono::steady_clock::now()) {}
+
+ScopedTrace::~ScopedTrace() {
+    TraceSink *sink = activeSink;
+    if (!sink) return;
+
+    const auto end = std::chrono::steady_clock::now();
+    sink->record({
+        name,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(start - traceEpoch).count(),
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+        bytes,
+        features,
+        currentFrame,
+        traceThreadId(),
+    });
+}
+
+void TraceRecorder::record(const TraceEvent &event) {
+    std::lock_guard lock(mutex);
+    recorded.push_back(event);
+}
+
+void TraceRecorder::clear() {
+    std::lock_guard lock(mutex);
+    recorded.clear();
+}
+
+std::vector<TraceEvent> TraceRecorder::events() const {
+    std::lock_guard lock(mutex);
+    return recorded;
+}
+
+std::map<std::string, StageStatistics> TraceRecorder::stageStatistics() const {
+    std::map<std::string, std::vector<double>> durations;
+    std::map<std::string, StageStatistics> statistics;
+
+    for (const auto &event : events()) {
+        const double ms = event.durationNs / 1e6;
+        auto &stage = statistics[event.name];
+        stage.count++;
+        stage.totalMs += ms;
+        stage.bytes += event.bytes;
+        stage.features += event.features;
+        durations[event.name].push_back(ms);
+    }
+
+    // Nearest-rank percentiles
+    for (auto &[name, samples] : durations) {
+        std::sort(samples.begin(), samples.end());
+        auto percentile = [&samples](double p) {
+            const size_t rank = static_cast<size_t>(std::ceil(p * samples.size()));
+            return samples[std::clamp<size_t>(rank, 1, samples.size()) - 1];
+        };
+
+        auto &stage = statistics[name];
+        stage.p50Ms = percentile(0.50);
+        stage.p90Ms = percentile(0.90);
+        stage.p99Ms = percentile(0.99);
+        stage.maxMs = samples.back();
+    }
+
+    return statistics;
+}
+
+void TraceRecorder::writeChromeTrace(std::ostream &out) const {
+    // Fixed notation keeps timestamps exact once a run lasts more than a few seconds
+    out << std::fixed << std::setprecision(3);
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto &event : events()) {
+        if (!first) out << ",";
+        first = false;
+
+        // Complete events with timestamps in microseconds
+        out << "\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread
+            << ",\"ts\":" << event.startNs / 1000.0 << ",\"dur\":" << event.durationNs / 1000.0
+            << ",\"args\":{\"frame\":" << event.frame << ",\"bytes\":" << event.bytes << ",\"features\":" << event.features << "}}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    out << std::defaultfloat;
+}
+
+void TraceRecorder::writeCsv(std::ostream &out) const {
+    out << std::fixed << std::setprecision(3);
+    out << "frame,stage,thread,start_us,duration_us,bytes,features\n";
+    for (const auto &event : events()) {
+        out << event.frame << "," << event.name << "," << event.thread << "," << event.startNs / 1000.0 << ","
+            << event.durationNs / 1000.0 << "," << event.bytes << "," << event.features << "\n";
+    }
+    out << std::defaultfloat;
+}
+
+void TraceRecorder::writeStageSummary(std::ostream &out) const {
+    out << std::left << std::setw(24) << "stage" << std::right << std::setw(8) << "count" << std::setw(12) << "total ms"
+        << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms" << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << "\n";
+    out << std::fixed << std::setprecision(3);
+    for (const auto &[name, stage] : stageStatistics()) {
+        out << std::left << std::setw(24) << name << std::right << std::setw(8) << stage.count << std::setw(12) << stage.totalMs
+            << std::setw(10) << stage.p50Ms << std::setw(10) << stage.p90Ms << std::setw(10) << stage.p99Ms << std::setw(10) << stage.maxMs << "\n";
+    }
+    out << std::defaultfloat;
+}